@@ -3,18 +3,100 @@
 
 #include <EIGEN_SETTINGS.h>
 #include <stdio.h>
+#include <memory>
+#include <mutex>
 #include "layer.h"
+#include "composite.h"
+#include "tiff_writer.h"
+#include "hash.h"
+#include "scheduler.h"
+
+// Alpha from which a tile counts as hiding everything under it
+#define OPAQUE_ALPHA (1 - 1e-6f)
+// Frame pixels a layer may travel between motion blur samples
+#define MOTION_BLUR_STEP 1.0f
+// Frames renderCompToFolder() works on at once, each with a frame buffer and
+// a buffer per layer being drawn
+#define RENDER_FRAMES_IN_FLIGHT 3
+// Layers of one frame that may be drawn ahead of the one being blended, each
+// holding a buffer until it's blended
+#define RENDER_LAYERS_IN_FLIGHT 2
 
 class Comp : public Layer{
+	// Where layers draw before they are blended. A matted layer and its matte
+	// each get one of their own, and under collects the layers composited
+	// front to back. A motion blurred layer draws each sample into sample and
+	// adds it into blurred.
+	struct Scratch{
+		ScratchBuffer layer, matte, matted, under, sample, blurred;
+	};
+
+	// A layer drawn by a task on its own, waiting to be blended
+	struct LayerRender{
+		Scratch scratch;
+		ScratchBuffer drawn;
+		ImageView view;
+		TileMask written;
+	};
+
+	// What the tasks addRenderTasks() adds for one frame share. under is where
+	// the layers that go front to back collect, and open the tiles they haven't
+	// yet hidden.
+	struct FrameRender{
+		std::vector<LayerRender *> layers;
+		LayerRender * under = nullptr;
+		TileMask open;
+		std::mutex mutex; // Guards open, which changes while later layers start drawing
+	};
+
 	int _xRes, _yRes;
 	float _frame_rate;
-	std::vector<Layer *> _layers; // How to free this? can I use delete[]?
+	std::vector<Layer *> _layers; // Owned
+
+	float _shutter_angle = 0;
+	int _blur_samples = 1;
+
+	// Kept between renders so that every frame doesn't allocate and clear them
+	// again. A render that finds them in use (another thread rendering this
+	// comp) makes its own.
+	Scratch _scratch;
+	std::mutex _scratch_mutex;
+
+	// Kept for the same reason, for render tasks (see addRenderTasks())
+	std::vector<std::unique_ptr<LayerRender>> _renders;
+	std::vector<LayerRender *> _free_renders;
+	std::mutex _renders_mutex;
+
+	LayerRender * takeRender(){
+		std::lock_guard<std::mutex> lock(_renders_mutex);
+		if(_free_renders.empty()){
+			_renders.emplace_back(new LayerRender());
+			return _renders.back().get();
+		}
+		LayerRender * render = _free_renders.back();
+		_free_renders.pop_back();
+		return render;
+	}
+
+	void giveBack(LayerRender * render){
+		std::lock_guard<std::mutex> lock(_renders_mutex);
+		_free_renders.push_back(render);
+	}
+
+	// Layers from the returned index up are composited front to back (see
+	// render()), the rest bottom to top
+	int getFrontToBackSplit(){
+		int split = _layers.size();
+		while(split > 0 && _layers[split - 1]->getBlendMode() == BLEND_NORMAL){
+			split--;
+		}
+		return std::min(split + 1, (int)_layers.size());
+	}
 public:
 	Comp(int xRes, int yRes, float frame_rate): _xRes(xRes), _yRes(yRes), _frame_rate(frame_rate){}
 	~Comp(){
-		// Not sure about this one
 		for(int i = 0; i < _layers.size(); i++){
-			// delete _layers[i];
+			delete _layers[i];
 		}
 	}
 
@@ -23,56 +105,575 @@ public:
 		y = _yRes;
 	}
 
-	void render(ImageBuffer * target, float frame_num){
+	// Shutter angle in degrees (360 is open for a whole frame, centred on it)
+	// and the most samples a layer gets. 0 degrees or 1 sample turns motion
+	// blur off. A precomp blurs its own layers with its own settings.
+	void setMotionBlur(float shutter_angle, int max_samples){
+		_shutter_angle = shutter_angle;
+		_blur_samples = max_samples;
+	}
+
+	// Motion blur samples for layer at frame_num: one per MOTION_BLUR_STEP
+	// pixels it travels while the shutter is open, 1 if it holds still
+	int getBlurSamples(Layer * layer, float frame_num){
+		if(_shutter_angle <= 0 || _blur_samples <= 1)
+			return 1;
+		float open = _shutter_angle/720;
+		float motion = layer->getMotion(frame_num - open, frame_num + open, _xRes, _yRes);
+		return std::min(std::max((int)ceilf(motion/MOTION_BLUR_STEP), 1), _blur_samples);
+	}
+
+	float getContentMotion(float t0, float t1){
+		float motion = 0;
 		for(int i = 0; i < _layers.size(); i++){
-			ImageBuffer layerBuffer(_xRes, _yRes);
-			_layers[i]->render(&layerBuffer, frame_num);
+			motion = std::max(motion, _layers[i]->getMotion(t0, t1, _xRes, _yRes));
+		}
+		return motion;
+	}
 
-			for(int y = 0; y < _yRes; y++){
-				for(int x = 0; x < _xRes; x++){
-					Pixel * pix_new = layerBuffer.getPixel(x, y);
-					Pixel * pix_target = target->getPixel(x, y);
+	// Renders layer over [x0, x1) x [y0, y1) of the frame, then applies its masks
+	// and effects. The layer is drawn margin pixels further out on every side
+	// (within the frame) so that effects reading neighbours see the same pixels
+	// whichever region is asked for; a band of a frame comes out the same as
+	// that part of the whole frame. needed, if given, holds the tiles of the
+	// region whose result is used. The view returned covers just the region, and
+	// occupied gets the tiles of it that hold anything.
+	static ImageView renderSource(Layer * layer, ScratchBuffer& scratch, int x0, int y0, int x1, int y1,
+		int margin, int frameWidth, int frameHeight, float frame_num, const TileMask * needed, TileMask& occupied){
+		int rx0 = std::max(x0 - margin, 0), ry0 = std::max(y0 - margin, 0);
+		int rx1 = std::min(x1 + margin, frameWidth), ry1 = std::min(y1 + margin, frameHeight);
+		ImageView rendered = scratch.acquire(rx0, ry0, rx1, ry1, frameWidth, frameHeight);
 
-					VEC3 vec_new = pix_new->toVec3();
-					VEC3 vec_target = pix_target->toVec3();
+		// Effects pull neighbours in from up to margin away, and nothing outside the
+		// masks survives them
+		TileMask coverage;
+		bool restricted = (needed || layer->hasMasks());
+		if(restricted){
+			coverage = (needed ? needed->dilated(margin) : TileMask(rx0, ry0, rx1, ry1, true));
+			coverage.intersect(layer->getMaskTiles(rx0, ry0, rx1, ry1));
+		}
+
+		TileMask written(rx0, ry0, rx1, ry1);
+		if(!restricted || !coverage.isEmpty()){
+			if(layer->tracksWrites())
+				layer->render(rendered.tracking(&written), frame_num, restricted ? &coverage : nullptr);
+			else{
+				layer->render(rendered, frame_num, restricted ? &coverage : nullptr);
+				written = TileMask(rx0, ry0, rx1, ry1, true);
+			}
+			layer->applyMasks(rendered, written);
+			layer->applyEffects(rendered, frame_num);
+			// Effects spread what was written by up to their margin
+			written = written.dilated(margin);
+		}
+
+		scratch.setWritten(written);
+		occupied = written;
+		return rendered.sub(x0, y0, x1 - x0, y1 - y0);
+	}
 
-					// You would do blending stuff here but not right now
-					pix_target->set(vec_new + vec_target);
+	// Renders layer and blends it into target, transformed if it has a transform.
+	// Only the tiles the layer wrote, and that coverage (if given) asks for, are
+	// blended.
+	static void compositeLayer(Layer * layer, const ImageView& target, float frame_num, float opacity, BlendMode mode,
+		const TileMask * coverage, ScratchBuffer& scratch){
+		int frameWidth = target.getFrameWidth(), frameHeight = target.getFrameHeight();
+		int margin = layer->getEffectMargin(frame_num);
+		TileMask occupied;
+
+		if(!layer->hasTransform()){
+			ImageView rendered = renderSource(layer, scratch, target.getX0(), target.getY0(), target.getX1(), target.getY1(),
+				margin, frameWidth, frameHeight, frame_num, coverage, occupied);
+			if(coverage)
+				occupied.intersect(*coverage);
+			compositeIdentity(rendered, target, opacity, mode, &occupied);
+			return;
+		}
+
+		float m[6], inverse[6];
+		layer->getTransform(frame_num, m);
+		if(!invertAffine(m, inverse))
+			return;
+
+		// Part of target the transformed layer can reach. Texels fade out over one
+		// pixel past the layer's edge under bilinear filtering.
+		int dx0, dy0, dx1, dy1;
+		transformBounds(m, -1, -1, frameWidth, frameHeight, dx0, dy0, dx1, dy1);
+		dx0 = std::max(dx0, target.getX0()); dx1 = std::min(dx1, target.getX1());
+		dy0 = std::max(dy0, target.getY0()); dy1 = std::min(dy1, target.getY1());
+		if(dx1 <= dx0 || dy1 <= dy0)
+			return;
+
+		// Part of the layer those pixels sample from, plus the bilinear neighbour
+		int sx0, sy0, sx1, sy1;
+		transformBounds(inverse, dx0, dy0, dx1 - 1, dy1 - 1, sx0, sy0, sx1, sy1);
+		sx0 = std::max(sx0, 0); sx1 = std::min(sx1 + 1, frameWidth);
+		sy0 = std::max(sy0, 0); sy1 = std::min(sy1 + 1, frameHeight);
+		if(sx1 <= sx0 || sy1 <= sy0)
+			return;
+
+		TileMask needed;
+		if(coverage)
+			needed = mapTiles(*coverage, m, sx0, sy0, sx1, sy1);
+
+		ImageView source = renderSource(layer, scratch, sx0, sy0, sx1, sy1, margin, frameWidth, frameHeight,
+			frame_num, coverage ? &needed : nullptr, occupied);
+		TileMask reached = mapTiles(occupied, inverse, dx0, dy0, dx1, dy1);
+		if(coverage)
+			reached.intersect(*coverage);
+		compositeAffine(source, target, inverse, dx0, dy0, dx1, dy1, opacity, mode, &reached);
+	}
+
+	// Blends layer into target, through its track matte if it has one. The matte
+	// and matted layer each draw into a target sized scratch buffer first.
+	static void compositeStacked(Layer * layer, const ImageView& target, float frame_num, BlendMode mode,
+		const TileMask * coverage, ScratchBuffer& scratch, ScratchBuffer& matteScratch, ScratchBuffer& mattedScratch){
+		float opacity = layer->getOpacity(frame_num);
+		if(opacity <= 0)
+			return;
+
+		Layer * matte = layer->getTrackMatte();
+		if(!matte){
+			compositeLayer(layer, target, frame_num, opacity, mode, coverage, scratch);
+			return;
+		}
+
+		int frameWidth = target.getFrameWidth(), frameHeight = target.getFrameHeight();
+		int x0 = target.getX0(), y0 = target.getY0(), x1 = target.getX1(), y1 = target.getY1();
+
+		// The matte goes first, and the layer only draws the tiles it doesn't hide
+		ImageView matteView = matteScratch.acquire(x0, y0, x1, y1, frameWidth, frameHeight);
+		TileMask matteWritten(x0, y0, x1, y1);
+		float matteOpacity = matte->getOpacity(frame_num);
+		if(matteOpacity > 0)
+			compositeLayer(matte, matteView.tracking(&matteWritten), frame_num, matteOpacity, BLEND_NORMAL, coverage, scratch);
+		matteScratch.setWritten(matteWritten);
+
+		TileMask matteCoverage = matteTiles(matteView, layer->getMatteMode(), &matteWritten);
+		if(coverage)
+			matteCoverage.intersect(*coverage);
+		if(matteCoverage.isEmpty())
+			return;
+
+		ImageView mattedView = mattedScratch.acquire(x0, y0, x1, y1, frameWidth, frameHeight);
+		TileMask mattedWritten(x0, y0, x1, y1);
+		compositeLayer(layer, mattedView.tracking(&mattedWritten), frame_num, 1, BLEND_NORMAL, &matteCoverage, scratch);
+		mattedScratch.setWritten(mattedWritten);
+		applyMatte(mattedView, matteView, layer->getMatteMode(), &mattedWritten);
+		compositeIdentity(mattedView, target, opacity, mode, &mattedWritten);
+	}
+
+	// Blends layer into target like compositeStacked, with motion blur: a layer
+	// that moves while the shutter is open is drawn at evenly spaced times
+	// across it and the drawings averaged, then blended as one. A layer that
+	// doesn't move is drawn once, at frame_num.
+	void compositeBlurred(Layer * layer, const ImageView& target, float frame_num, BlendMode mode,
+		const TileMask * coverage, Scratch& scratch){
+		int samples = getBlurSamples(layer, frame_num);
+		if(samples <= 1){
+			compositeStacked(layer, target, frame_num, mode, coverage, scratch.layer, scratch.matte, scratch.matted);
+			return;
+		}
+
+		int frameWidth = target.getFrameWidth(), frameHeight = target.getFrameHeight();
+		int x0 = target.getX0(), y0 = target.getY0(), x1 = target.getX1(), y1 = target.getY1();
+		float open = _shutter_angle/360;
+
+		ImageView blurredView = scratch.blurred.acquire(x0, y0, x1, y1, frameWidth, frameHeight);
+		TileMask blurredWritten(x0, y0, x1, y1);
+		for(int s = 0; s < samples; s++){
+			float time = frame_num + open*((s + 0.5f)/samples - 0.5f);
+			ImageView sampleView = scratch.sample.acquire(x0, y0, x1, y1, frameWidth, frameHeight);
+			TileMask sampleWritten(x0, y0, x1, y1);
+			compositeStacked(layer, sampleView.tracking(&sampleWritten), time, BLEND_NORMAL, coverage,
+				scratch.layer, scratch.matte, scratch.matted);
+			scratch.sample.setWritten(sampleWritten);
+			accumulatePixels(sampleView, blurredView, 1.0f/samples, &sampleWritten);
+			blurredWritten.merge(sampleWritten);
+		}
+		scratch.blurred.setWritten(blurredWritten);
+		compositeIdentity(blurredView, target, 1, mode, &blurredWritten);
+	}
+
+	// Clears the tiles of open that buffer now covers completely. Only tiles in
+	// written can have anything in them.
+	static void closeOpaqueTiles(const ImageView& buffer, const TileMask& written, TileMask& open){
+		for(int ty = open.getTileY0(); ty < open.getTileY0() + open.getTilesY(); ty++){
+			for(int tx = open.getTileX0(); tx < open.getTileX0() + open.getTilesX(); tx++){
+				if(!open.test(tx, ty) || !written.test(tx, ty))
+					continue;
+
+				ImageView tile = buffer.sub(tx*TILE_SIZE, ty*TILE_SIZE, TILE_SIZE, TILE_SIZE);
+				bool opaque = true;
+				for(int y = tile.getY0(); y < tile.getY1() && opaque; y++){
+					const Pixel * row = tile.row(y);
+					for(int x = 0; x < tile.getWidth(); x++){
+						if(row[x].getA() < OPAQUE_ALPHA){
+							opaque = false;
+							break;
+						}
+					}
 				}
+				if(opaque)
+					open.set(tx, ty, false);
 			}
 		}
+	}
+
+	bool tracksWrites(){return true;}
 
-		
+	// Layers are composited front to back: the top ones go under each other into
+	// a buffer of their own, and once a tile of it is opaque nothing further down
+	// is rendered or blended there. Over is associative, so the result is the
+	// same as blending bottom to top. The rest, from the lowest of those and the
+	// topmost layer that doesn't blend normally (it has to see everything under
+	// it) down, are blended bottom to top into target as usual, just skipping the
+	// tiles already hidden, and then the buffer goes over the result.
+	void render(const ImageView& target, float frame_num, const TileMask * coverage = nullptr){
+		if(coverage && coverage->isEmpty())
+			return;
 
+		std::unique_lock<std::mutex> lock(_scratch_mutex, std::try_to_lock);
+		std::unique_ptr<Scratch> own;
+		if(!lock.owns_lock())
+			own.reset(new Scratch());
+		Scratch& scratch = (own ? *own : _scratch);
+		int frameWidth = target.getFrameWidth(), frameHeight = target.getFrameHeight();
+		int x0 = target.getX0(), y0 = target.getY0(), x1 = target.getX1(), y1 = target.getY1();
+
+		// Layers [split, size) go front to back
+		int split = getFrontToBackSplit();
+
+		// Tiles still showing what's below the layers done so far. Layers get no
+		// coverage at all until something is hidden or left out.
+		TileMask open(x0, y0, x1, y1, true);
+		if(coverage)
+			open.intersect(*coverage);
+		int allTiles = open.getTilesX()*open.getTilesY();
+		auto needed = [&]{return (coverage || open.count() < allTiles ? &open : nullptr);};
+
+		ImageView underView;
+		TileMask underWritten(x0, y0, x1, y1);
+		if(split < _layers.size())
+			underView = scratch.under.acquire(x0, y0, x1, y1, frameWidth, frameHeight);
+		for(int i = _layers.size() - 1; i >= split && !open.isEmpty(); i--){
+			compositeBlurred(_layers[i], underView.tracking(&underWritten), frame_num, BLEND_UNDER, needed(), scratch);
+			closeOpaqueTiles(underView, underWritten, open);
+		}
+
+		for(int i = 0; i < split && !open.isEmpty(); i++){
+			compositeBlurred(_layers[i], target, frame_num, _layers[i]->getBlendMode(), needed(), scratch);
+		}
+
+		if(!underWritten.isEmpty())
+			compositeIdentity(underView, target, 1, BLEND_NORMAL, &underWritten);
+		if(split < _layers.size())
+			scratch.under.setWritten(underWritten);
+	}
+
+	// Adds the tasks that render frame_num of the comp into target, which
+	// already holds the background, to graph, compositing the way render()
+	// does. Per layer one task draws it into a buffer of its own and another
+	// blends that in, under the layers above it or onto target; blending goes
+	// in render()'s order, while up to RENDER_LAYERS_IN_FLIGHT layers draw
+	// ahead of it. A layer draws only the tiles left open when it starts, so
+	// hidden tiles are mostly skipped (a layer drawing ahead may draw some that
+	// get hidden before it's blended, which are then left out). The drawing
+	// tasks wait for after and, since a layer can only draw one frame at a
+	// time, for the same layer's drawing task in previous (which is updated, -1
+	// for none). Returns the last task.
+	int addRenderTasks(TaskGraph& graph, const ImageView& target, float frame_num, int priority, int after, std::vector<int>& previous){
+		previous.resize(_layers.size(), -1);
+		int layers = _layers.size(), split = getFrontToBackSplit();
+		int x0 = target.getX0(), y0 = target.getY0(), x1 = target.getX1(), y1 = target.getY1();
+		int frameWidth = target.getFrameWidth(), frameHeight = target.getFrameHeight();
+		std::string frame = "frame " + std::to_string((int)frame_num);
+
+		std::shared_ptr<FrameRender> state = std::make_shared<FrameRender>();
+		state->layers.resize(layers, nullptr);
+		state->open = TileMask(x0, y0, x1, y1, true);
+		int allTiles = state->open.getTilesX()*state->open.getTilesY();
+
+		auto addDraw = [&](int i){
+			Layer * layer = _layers[i];
+			int draw = graph.add(frame + " layer " + std::to_string(i) + " draw", priority, [=]{
+				TileMask open;
+				{
+					std::lock_guard<std::mutex> lock(state->mutex);
+					open = state->open;
+				}
+				if(open.isEmpty())
+					return;
+
+				LayerRender * r = takeRender();
+				r->view = r->drawn.acquire(x0, y0, x1, y1, frameWidth, frameHeight);
+				r->written = TileMask(x0, y0, x1, y1);
+				compositeBlurred(layer, r->view.tracking(&r->written), frame_num, BLEND_NORMAL,
+					open.count() < allTiles ? &open : nullptr, r->scratch);
+				r->drawn.setWritten(r->written);
+				state->layers[i] = r;
+			});
+			graph.depend(draw, after);
+			graph.depend(draw, previous[i]);
+			previous[i] = draw;
+			return draw;
+		};
+
+		// Drawn over transparent with the layer's opacity, so blending them at
+		// full opacity gives what blending the layers directly would
+		std::vector<int> blends(layers, -1);
+		int last = after;
+		for(int i = layers - 1; i >= split; i--){
+			int draw = addDraw(i);
+			if(i + RENDER_LAYERS_IN_FLIGHT < layers)
+				graph.depend(draw, blends[i + RENDER_LAYERS_IN_FLIGHT]);
+
+			// Only these tasks change open, one after another
+			int blend = graph.add(frame + " layer " + std::to_string(i) + " under", priority, [=]{
+				LayerRender * r = state->layers[i];
+				if(!r)
+					return;
+				if(!state->under){
+					state->under = takeRender();
+					state->under->view = state->under->drawn.acquire(x0, y0, x1, y1, frameWidth, frameHeight);
+					state->under->written = TileMask(x0, y0, x1, y1);
+				}
+
+				TileMask open = state->open;
+				r->written.intersect(open);
+				if(!r->written.isEmpty())
+					compositeIdentity(r->view, state->under->view.tracking(&state->under->written), 1, BLEND_UNDER, &r->written);
+				giveBack(r);
+				closeOpaqueTiles(state->under->view, state->under->written, open);
+
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->open = open;
+			});
+			graph.depend(blend, draw);
+			graph.depend(blend, last);
+			blends[i] = blend;
+			last = blend;
+		}
+
+		// Everything front to back is in, so open won't change again
+		int front = last;
+		for(int i = 0; i < split; i++){
+			Layer * layer = _layers[i];
+			int draw = addDraw(i);
+			graph.depend(draw, front);
+			if(i >= RENDER_LAYERS_IN_FLIGHT)
+				graph.depend(draw, blends[i - RENDER_LAYERS_IN_FLIGHT]);
+
+			int blend = graph.add(frame + " layer " + std::to_string(i) + " blend", priority, [=]{
+				LayerRender * r = state->layers[i];
+				if(!r)
+					return;
+				if(!r->written.isEmpty())
+					compositeIdentity(r->view, target, 1, layer->getBlendMode(), &r->written);
+				giveBack(r);
+			});
+			graph.depend(blend, draw);
+			graph.depend(blend, last);
+			blends[i] = blend;
+			last = blend;
+		}
+
+		int over = graph.add(frame + " under over", priority, [=]{
+			LayerRender * under = state->under;
+			if(!under)
+				return;
+			if(!under->written.isEmpty())
+				compositeIdentity(under->view, target, 1, BLEND_NORMAL, &under->written);
+			under->drawn.setWritten(under->written);
+			giveBack(under);
+			state->under = nullptr;
+		});
+		graph.depend(over, last);
+		return over;
+	}
+
+	// Frees the buffers kept for render tasks. Only once none are running.
+	void releaseRenders(){
+		std::lock_guard<std::mutex> lock(_renders_mutex);
+		if(_free_renders.size() != _renders.size()){
+			ERROR("ERROR - COMP - Can't release render buffers still in use");
+			return;
+		}
+		_free_renders.clear();
+		_renders.clear();
 	}
 
+	// Takes ownership of layer
 	void addLayer(Layer * layer){
 		_layers.push_back(layer);
 	}
 
 };
 
-void renderCompToFolder(Comp * comp, int start_frame, int end_frame, char * folder){
+// Renders frames [start_frame, end_frame) to folder/%04i.tif (.lz4 with LZ4
+// compression, see OutputFormat). Whole frames run
+// as task graphs on the shared scheduler, layers and consecutive frames
+// overlapping, and the critical path is printed at the end. With
+// band_height > 0 each frame is rendered, composited and written band_height
+// rows at a time instead, one after another, so peak memory follows the band
+// size instead of the frame size.
+void renderCompToFolder(Comp * comp, int start_frame, int end_frame, char * folder,
+	const OutputFormat& format = OutputFormat(), int band_height = 0){
 	if(end_frame <= start_frame){
 		ERROR("ERROR - LAYER - Need at least 1 frame to render layer");
 		return;
 	}
 
+	// Frames the same as the one before (holds, static stretches) are hashed
+	// after quantizing and linked to the previous file instead of written
 	int xRes, yRes;
 	comp->getDimensions(xRes, yRes);
-	ImageBuffer * buffer = new ImageBuffer(xRes, yRes);
+	int repeats = 0;
+	std::string previous;
+	if(band_height <= 0 || band_height >= yRes){
+		// Each frame is a task graph (see Comp::addRenderTasks()) ending in
+		// quantizing and writing, and a few frames are worked on at once, each
+		// in one of these. Writes go in frame order.
+		struct Slot{
+			ImageBuffer buffer;
+			std::vector<uint8_t, TrackedAllocator<uint8_t, MEM_FRAMEBUFFERS>> pixels;
+			uint64_t hash;
+			Slot(int xRes, int yRes, const OutputFormat& format): buffer(xRes, yRes), pixels(buffer.getQuantizedBytes(format)), hash(0){}
+		};
+		std::vector<std::unique_ptr<Slot>> slots;
+		for(int i = 0; i < std::min(RENDER_FRAMES_IN_FLIGHT, end_frame - start_frame); i++){
+			slots.emplace_back(new Slot(xRes, yRes, format));
+		}
 
-	for(int frame = start_frame; frame < end_frame; frame++){
-		buffer->clear();
-		comp->render(buffer, frame);
+		TaskGraph graph;
+		std::vector<int> layerTasks, writes;
+		uint64_t previousHash = 0;
+		for(int frame = start_frame; frame < end_frame; frame++){
+			int n = frame - start_frame;
+			Slot * slot = slots[n%slots.size()].get();
+			std::string name = "frame " + std::to_string(frame);
+
+			// Not until the frame that had the slot before is written
+			int clear = graph.add(name + " clear", frame, [=]{slot->buffer.clear();});
+			if(n >= slots.size())
+				graph.depend(clear, writes[n - slots.size()]);
+
+			// With one thread there's nothing to overlap, and render() skips hidden tiles
+			int composited;
+			if(taskScheduler().getThreadCount() > 1){
+				composited = comp->addRenderTasks(graph, slot->buffer.view(), frame, frame, clear, layerTasks);
+			}else{
+				composited = graph.add(name + " render", frame, [=]{comp->render(slot->buffer.view(), frame);});
+				graph.depend(composited, clear);
+			}
+
+			int quantize = graph.add(name + " quantize", frame, [=, &format]{
+				slot->buffer.quantize(format, slot->pixels.data());
+				slot->hash = hashBytes(slot->pixels.data(), slot->pixels.size());
+			});
+			graph.depend(quantize, composited);
+
+			int write = graph.add(name + " write", frame, [=, &format, &previous, &previousHash, &repeats]{
+				char name[100];
+				sprintf(name, "%s/%04i.%s", folder, frame, frameExtension(format.compression));
+				if(!previous.empty() && slot->hash == previousHash && linkOrCopyFile(previous, name)){
+					PRINT("Frame " << name << " repeats " << previous);
+					repeats++;
+					return;
+				}
+
+				// May be a link to another frame from an earlier render
+				unlink(name);
+				if(writeQuantizedFrame(name, slot->pixels.data(), xRes, yRes, format)){
+					previous = name;
+					previousHash = slot->hash;
+				}else{
+					previous.clear();
+				}
+			});
+			graph.depend(write, quantize);
+			if(n > 0)
+				graph.depend(write, writes.back());
+			writes.push_back(write);
+		}
+
+		taskScheduler().run(graph);
+		comp->releaseRenders();
+		graph.printCriticalPath();
+		PRINT("Deduplicated " << repeats << " of " << (end_frame - start_frame) << " frames");
+		memoryTracker().printReport();
+		return;
+	}
 
+	// Each strip is hashed as it comes out. The file isn't opened until a strip
+	// differs from the previous frame's; the strips before it are copied over
+	// from the previous file, and if none differ the frame is a link. A
+	// compressed band is split into smaller strips, compressed in parallel.
+	ImageBuffer band(xRes, band_height);
+	std::vector<uint8_t, TrackedAllocator<uint8_t, MEM_FRAMEBUFFERS>> strip((size_t)xRes*band_height*3*format.bytesPerSample());
+	int rowsPerStrip = band_height;
+	if(format.compression != COMPRESS_NONE)
+		rowsPerStrip = stripRows(xRes*3*format.bytesPerSample(), band_height);
+	std::vector<uint64_t> previousHashes, hashes;
+	std::vector<uint32_t> previousStrips;
+	for(int frame = start_frame; frame < end_frame; frame++){
 		char name[100];
-		sprintf(name, "%s/%04i.tif", folder, frame);
-		buffer->writeTIFF(name);
+		sprintf(name, "%s/%04i.%s", folder, frame, frameExtension(format.compression));
+		std::unique_ptr<StripWriter> writer(newStripWriter(format.compression));
+		bool opened = false, failed = false;
+		hashes.clear();
+
+		for(int y0 = 0; y0 < yRes; y0 += band_height){
+			int rows = std::min(band_height, yRes - y0);
+			ImageView view = band.view(0, 0, xRes, rows).placed(0, y0, xRes, yRes);
+			view.clear();
+			comp->render(view, frame);
+
+			size_t bytes = (size_t)xRes*rows*3*format.bytesPerSample();
+			quantizeRows(view.row(y0), view.getStride(), xRes, rows, y0, format, strip.data());
+			int index = hashes.size();
+			hashes.push_back(hashBytes(strip.data(), bytes));
+			if(!opened && !previous.empty() && index < previousHashes.size() && hashes[index] == previousHashes[index])
+				continue;
+
+			if(!opened){
+				unlink(name);
+				if(!writer->open(name, xRes, yRes, format.bits, rowsPerStrip, format.compression) ||
+					(index > 0 && !writer->copyStrips(previous, previousStrips, index*(band_height/rowsPerStrip)))){
+					failed = true;
+					break;
+				}
+				opened = true;
+			}
+			writer->writeStrips(strip.data(), rows);
+		}
+		if(failed)
+			break;
+
+		if(!opened){
+			if(linkOrCopyFile(previous, name)){
+				PRINT("Frame " << name << " repeats " << previous);
+				repeats++;
+				continue;
+			}
+
+			// Rendered again with nothing to match, so every strip is written
+			previous.clear();
+			frame--;
+			continue;
+		}
+		if(writer->close()){
+			PRINT("Wrote file " << name << " successfully");
+			previous = name;
+			previousHashes.swap(hashes);
+			previousStrips = writer->getStripByteCounts();
+		}else{
+			previous.clear();
+		}
 	}
 
-	// cleanup
-	delete buffer;
+	PRINT("Deduplicated " << repeats << " of " << (end_frame - start_frame) << " frames");
+	memoryTracker().printReport();
 }
 
 #endif // COMP_H
\ No newline at end of file
@@ -0,0 +1,297 @@
+#ifndef COMPOSITE_H
+#define COMPOSITE_H
+
+#include <EIGEN_SETTINGS.h>
+#include <float.h>
+#include "image_buffer.h"
+#include "layer.h"
+#include "simd.h"
+#include "parallel.h"
+#include "tiles.h"
+
+// Compositing kernels. Pixels are premultiplied RGBA and are blended one at
+// a time as a float4; rows are spread over the thread pool.
+
+inline float4 blendPixel(const float4& src, const float4& dst, BlendMode mode){
+	if(mode == BLEND_ADD){
+		// Colours add, coverage saturates
+		static const float saturate[4] = {FLT_MAX, FLT_MAX, FLT_MAX, 1};
+		return min(src + dst, float4::load(saturate));
+	}
+	if(mode == BLEND_UNDER)
+		return dst + src*(float4(1.0f) - dst.splatW());
+	return src + dst*(float4(1.0f) - src.splatW());
+}
+
+// Blends src into dst where they overlap, both already in the same frame space.
+// With tiles, only the set tiles of src are blended; the rest must be transparent.
+void compositeIdentity(const ImageView& src, const ImageView& dst, float opacity, BlendMode mode, const TileMask * tiles = nullptr){
+	ImageView region = dst.sub(src.getX0(), src.getY0(), src.getWidth(), src.getHeight());
+	if(region.isEmpty())
+		return;
+
+	float4 scale(opacity);
+	auto blendSpan = [&](int y, int x0, int x1){
+		const Pixel * s = src.row(y) - src.getX0();
+		Pixel * d = region.row(y) - region.getX0();
+		for(int x = x0; x < x1; x++){
+			float4 sp = s[x].toFloat4();
+			if(opacity != 1)
+				sp = sp*scale;
+			d[x].set(blendPixel(sp, d[x].toFloat4(), mode));
+		}
+	};
+
+	parallelFor(region.getY0(), region.getY1(), 32, [&](int begin, int end){
+		for(int y = begin; y < end; y++){
+			if(tiles)
+				tiles->forEachRun(y, region.getX0(), region.getX1(), [&](int x0, int x1){blendSpan(y, x0, x1);});
+			else
+				blendSpan(y, region.getX0(), region.getX1());
+		}
+	});
+
+	if(tiles)
+		region.markWritten(*tiles);
+	else
+		region.markWritten(region.getX0(), region.getY0(), region.getX1(), region.getY1());
+}
+
+// Adds src times weight to dst where they overlap, for averaging several
+// renders (motion blur samples). Two pixels go through at a time as a float8.
+// With tiles, only the set tiles of src are added.
+void accumulatePixels(const ImageView& src, const ImageView& dst, float weight, const TileMask * tiles = nullptr){
+	ImageView region = dst.sub(src.getX0(), src.getY0(), src.getWidth(), src.getHeight());
+	if(region.isEmpty())
+		return;
+
+	float8 weight8(weight);
+	float4 weight4(weight);
+	auto addSpan = [&](int y, int x0, int x1){
+		const Pixel * s = src.row(y) - src.getX0();
+		Pixel * d = region.row(y) - region.getX0();
+		int x = x0;
+		for(; x + 2 <= x1; x += 2){
+			float8 sum = float8::load((const float *)&d[x]) + float8::load((const float *)&s[x])*weight8;
+			sum.store((float *)&d[x]);
+		}
+		if(x < x1)
+			d[x].set(d[x].toFloat4() + s[x].toFloat4()*weight4);
+	};
+
+	parallelFor(region.getY0(), region.getY1(), 32, [&](int begin, int end){
+		for(int y = begin; y < end; y++){
+			if(tiles)
+				tiles->forEachRun(y, region.getX0(), region.getX1(), [&](int x0, int x1){addSpan(y, x0, x1);});
+			else
+				addSpan(y, region.getX0(), region.getX1());
+		}
+	});
+
+	if(tiles)
+		region.markWritten(*tiles);
+	else
+		region.markWritten(region.getX0(), region.getY0(), region.getX1(), region.getY1());
+}
+
+// Texel (x, y) of src, transparent outside it
+inline float4 fetchTexel(const ImageView& src, int x, int y){
+	if(!src.contains(x, y))
+		return float4(0.0f);
+	return src.row(y)[x - src.getX0()].toFloat4();
+}
+
+// Range of x for which lo <= a*x + c <= hi, intersected with [x0, x1]
+inline void clipSpan(float a, float c, float lo, float hi, float& x0, float& x1){
+	if(fabs(a) < 1e-12f){
+		if(c < lo || c > hi){
+			x0 = 1;
+			x1 = 0;
+		}
+		return;
+	}
+
+	float e0 = (lo - c)/a, e1 = (hi - c)/a;
+	x0 = std::max(x0, std::min(e0, e1));
+	x1 = std::min(x1, std::max(e0, e1));
+}
+
+// Resamples src with bilinear filtering through inverse (frame to layer, 2x3) and
+// blends the result into dst in one pass. Only dst pixels inside bounds are
+// visited, and on each row only the span whose footprint can reach src. With
+// tiles (frame space, from mapTiles) only pixels in its set tiles are visited.
+void compositeAffine(const ImageView& src, const ImageView& dst, const float inverse[6],
+	int boundsX0, int boundsY0, int boundsX1, int boundsY1, float opacity, BlendMode mode, const TileMask * tiles = nullptr){
+	ImageView region = dst.sub(boundsX0, boundsY0, boundsX1 - boundsX0, boundsY1 - boundsY0);
+	if(region.isEmpty() || src.isEmpty())
+		return;
+
+	float4 scale(opacity);
+	auto blendSpan = [&](int y, int x0, int x1, float cu, float cv){
+		Pixel * d = region.row(y) - region.getX0();
+		for(int x = x0; x <= x1; x++){
+			float u = inverse[0]*x + cu;
+			float v = inverse[3]*x + cv;
+			float fu = std::floor(u), fv = std::floor(v);
+			int iu = (int)fu, iv = (int)fv;
+			float4 wu(u - fu), wv(v - fv);
+
+			float4 p00, p10, p01, p11;
+			if(iu >= src.getX0() && iu + 1 < src.getX1() && iv >= src.getY0() && iv + 1 < src.getY1()){
+				const Pixel * r0 = src.row(iv) + (iu - src.getX0());
+				const Pixel * r1 = r0 + src.getStride();
+				p00 = r0->toFloat4();
+				p10 = r0[1].toFloat4();
+				p01 = r1->toFloat4();
+				p11 = r1[1].toFloat4();
+			}else{
+				p00 = fetchTexel(src, iu, iv);
+				p10 = fetchTexel(src, iu + 1, iv);
+				p01 = fetchTexel(src, iu, iv + 1);
+				p11 = fetchTexel(src, iu + 1, iv + 1);
+			}
+
+			float4 top = p00 + (p10 - p00)*wu;
+			float4 bottom = p01 + (p11 - p01)*wu;
+			float4 sample = (top + (bottom - top)*wv)*scale;
+			d[x].set(blendPixel(sample, d[x].toFloat4(), mode));
+		}
+	};
+
+	parallelFor(region.getY0(), region.getY1(), 16, [&](int begin, int end){
+		for(int y = begin; y < end; y++){
+			// Source coordinates along the row are u = inverse[0]*x + cu, v = inverse[3]*x + cv
+			float cu = inverse[1]*y + inverse[2];
+			float cv = inverse[4]*y + inverse[5];
+
+			float spanX0 = region.getX0(), spanX1 = region.getX1() - 1;
+			clipSpan(inverse[0], cu, src.getX0() - 1, src.getX1(), spanX0, spanX1);
+			clipSpan(inverse[3], cv, src.getY0() - 1, src.getY1(), spanX0, spanX1);
+			int x0 = std::max(region.getX0(), (int)std::floor(spanX0));
+			int x1 = std::min(region.getX1() - 1, (int)std::ceil(spanX1));
+
+			if(tiles)
+				tiles->forEachRun(y, x0, x1 + 1, [&](int run0, int run1){blendSpan(y, run0, run1 - 1, cu, cv);});
+			else
+				blendSpan(y, x0, x1, cu, cv);
+		}
+	});
+
+	if(tiles)
+		region.markWritten(*tiles);
+	else
+		region.markWritten(region.getX0(), region.getY0(), region.getX1(), region.getY1());
+}
+
+// How much of the matted layer a matte pixel lets through
+inline float matteValue(const Pixel& p, MatteMode mode){
+	float v = p.getA();
+	if(mode == MATTE_LUMA || mode == MATTE_LUMA_INVERTED)
+		v = 0.2126f*p.getR() + 0.7152f*p.getG() + 0.0722f*p.getB();
+	v = clamp(0, 1, v);
+	return (mode == MATTE_ALPHA_INVERTED || mode == MATTE_LUMA_INVERTED ? 1 - v : v);
+}
+
+// Tiles of matte holding any pixel that lets something through. With written,
+// tiles it leaves out are known to be transparent and aren't looked at.
+TileMask matteTiles(const ImageView& matte, MatteMode mode, const TileMask * written = nullptr){
+	TileMask tiles(matte.getX0(), matte.getY0(), matte.getX1(), matte.getY1());
+	bool inverted = (mode == MATTE_ALPHA_INVERTED || mode == MATTE_LUMA_INVERTED);
+	int ty0 = tiles.getTileY0();
+	parallelFor(ty0, ty0 + tiles.getTilesY(), 1, [&](int begin, int end){
+		for(int ty = begin; ty < end; ty++){
+			int y0 = std::max(ty*TILE_SIZE, matte.getY0()), y1 = std::min((ty + 1)*TILE_SIZE, matte.getY1());
+			for(int tx = tiles.getTileX0(); tx < tiles.getTileX0() + tiles.getTilesX(); tx++){
+				if(written && !written->test(tx, ty)){
+					tiles.set(tx, ty, inverted);
+					continue;
+				}
+
+				int x0 = std::max(tx*TILE_SIZE, matte.getX0()), x1 = std::min((tx + 1)*TILE_SIZE, matte.getX1());
+				bool visible = false;
+				for(int y = y0; y < y1 && !visible; y++){
+					const Pixel * row = matte.row(y) - matte.getX0();
+					for(int x = x0; x < x1 && !visible; x++){
+						visible = (matteValue(row[x], mode) > 0);
+					}
+				}
+				tiles.set(tx, ty, visible);
+			}
+		}
+	});
+	return tiles;
+}
+
+// Scales every pixel of layer by the matte pixel at the same place. With
+// written, only its tiles of layer are touched; the rest must be transparent.
+void applyMatte(const ImageView& layer, const ImageView& matte, MatteMode mode, const TileMask * written = nullptr){
+	ImageView region = layer.sub(matte.getX0(), matte.getY0(), matte.getWidth(), matte.getHeight());
+	auto matteSpan = [&](int y, int x0, int x1){
+		Pixel * l = region.row(y) - region.getX0();
+		const Pixel * m = matte.row(y) - matte.getX0();
+		for(int x = x0; x < x1; x++){
+			l[x].set(l[x].toFloat4()*float4(matteValue(m[x], mode)));
+		}
+	};
+
+	parallelFor(region.getY0(), region.getY1(), 32, [&](int begin, int end){
+		for(int y = begin; y < end; y++){
+			if(written)
+				written->forEachRun(y, region.getX0(), region.getX1(), [&](int x0, int x1){matteSpan(y, x0, x1);});
+			else
+				matteSpan(y, region.getX0(), region.getX1());
+		}
+	});
+}
+
+// Inverts a 2x3 affine matrix, false if it is singular
+bool invertAffine(const float m[6], float inverse[6]){
+	float det = m[0]*m[4] - m[1]*m[3];
+	if(fabs(det) < 1e-12f)
+		return false;
+
+	float inv = 1/det;
+	inverse[0] = m[4]*inv;
+	inverse[1] = -m[1]*inv;
+	inverse[3] = -m[3]*inv;
+	inverse[4] = m[0]*inv;
+	inverse[2] = -(inverse[0]*m[2] + inverse[1]*m[5]);
+	inverse[5] = -(inverse[3]*m[2] + inverse[4]*m[5]);
+	return true;
+}
+
+// Bounding box of the rectangle [x0, x1] x [y0, y1] under m, rounded outwards
+void transformBounds(const float m[6], float x0, float y0, float x1, float y1,
+	int& out_x0, int& out_y0, int& out_x1, int& out_y1){
+	float xs[4] = {x0, x1, x0, x1};
+	float ys[4] = {y0, y0, y1, y1};
+	float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+	for(int i = 0; i < 4; i++){
+		float tx = m[0]*xs[i] + m[1]*ys[i] + m[2];
+		float ty = m[3]*xs[i] + m[4]*ys[i] + m[5];
+		minX = std::min(minX, tx); maxX = std::max(maxX, tx);
+		minY = std::min(minY, ty); maxY = std::max(maxY, ty);
+	}
+	out_x0 = (int)std::floor(minX);
+	out_y0 = (int)std::floor(minY);
+	out_x1 = (int)std::ceil(maxX) + 1;
+	out_y1 = (int)std::ceil(maxY) + 1;
+}
+
+// Tiles of the rectangle [x0, x1) x [y0, y1) that m takes, with their bilinear
+// footprint, onto a set tile of from. Moves tile masks between a layer's own
+// space and frame space, in either direction.
+TileMask mapTiles(const TileMask& from, const float m[6], int x0, int y0, int x1, int y1){
+	TileMask tiles(x0, y0, x1, y1);
+	for(int ty = tiles.getTileY0(); ty < tiles.getTileY0() + tiles.getTilesY(); ty++){
+		for(int tx = tiles.getTileX0(); tx < tiles.getTileX0() + tiles.getTilesX(); tx++){
+			int fx0, fy0, fx1, fy1;
+			transformBounds(m, tx*TILE_SIZE - 1, ty*TILE_SIZE - 1, (tx + 1)*TILE_SIZE, (ty + 1)*TILE_SIZE, fx0, fy0, fx1, fy1);
+			if(from.any(fx0, fy0, fx1, fy1))
+				tiles.set(tx, ty);
+		}
+	}
+	return tiles;
+}
+
+#endif // COMPOSITE_H
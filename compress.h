@@ -0,0 +1,167 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <EIGEN_SETTINGS.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <zlib.h>
+
+// Byte codecs for frame files: PackBits and Deflate as TIFF uses them, and
+// LZ4 blocks for the raw frame cache format. Each appends to out and works on
+// one strip at a time, so strips can be compressed on different threads.
+
+#define DEFLATE_LEVEL 4
+
+#define LZ4_HASH_BITS 14
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // The format ends every block on this many literals
+#define LZ4_MATCH_LIMIT 12  // and starts no match this close to the end
+#define LZ4_MAX_OFFSET 65535
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////PACKBITS////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// One row, TIFF style: a header byte n then either n+1 literal bytes
+// (0 <= n <= 127) or one byte repeated 1-n times (-127 <= n <= -1)
+void packBits(const uint8_t * in, size_t n, std::vector<uint8_t>& out){
+	size_t i = 0;
+	while(i < n){
+		size_t run = 1;
+		while(i + run < n && run < 128 && in[i + run] == in[i])
+			run++;
+		if(run >= 2){
+			out.push_back((uint8_t)(1 - (int)run));
+			out.push_back(in[i]);
+			i += run;
+			continue;
+		}
+
+		// Literals until a run of 3 starts, a run of 2 costs as much either way
+		size_t start = i++;
+		while(i < n && i - start < 128 && !(i + 2 < n && in[i] == in[i + 1] && in[i] == in[i + 2]))
+			i++;
+		out.push_back((uint8_t)(i - start - 1));
+		out.insert(out.end(), in + start, in + i);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////DEFLATE////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Replaces each sample of packed RGB rows with its difference from the same
+// channel of the pixel to its left (TIFF predictor 2). Smooth gradients turn
+// into runs of small numbers, which Deflate packs much better.
+void differenceRows(uint8_t * data, int width, int rows, int bits){
+	for(int y = 0; y < rows; y++){
+		if(bits == 16){
+			uint16_t * row = (uint16_t *)data + (size_t)y*width*3;
+			for(int i = width*3 - 1; i >= 3; i--){
+				row[i] -= row[i - 3];
+			}
+		}else{
+			uint8_t * row = data + (size_t)y*width*3;
+			for(int i = width*3 - 1; i >= 3; i--){
+				row[i] -= row[i - 3];
+			}
+		}
+	}
+}
+
+// A zlib stream, which is what TIFF's Deflate compression holds
+bool deflateBytes(const uint8_t * in, size_t n, std::vector<uint8_t>& out){
+	size_t start = out.size();
+	uLongf bytes = compressBound(n);
+	out.resize(start + bytes);
+	if(compress2(&out[start], &bytes, in, n, DEFLATE_LEVEL) != Z_OK){
+		ERROR("ERROR - COMPRESS - Deflate failed on " << n << " bytes");
+		out.resize(start);
+		return false;
+	}
+	out.resize(start + bytes);
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////LZ4//////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+inline void lz4Length(std::vector<uint8_t>& out, size_t length){
+	while(length >= 255){
+		out.push_back(255);
+		length -= 255;
+	}
+	out.push_back(length);
+}
+
+inline void lz4Sequence(std::vector<uint8_t>& out, const uint8_t * literals, size_t count, size_t offset, size_t match){
+	size_t extra = match - LZ4_MIN_MATCH;
+	out.push_back((std::min(count, (size_t)15) << 4) | (match ? std::min(extra, (size_t)15) : 0));
+	if(count >= 15)
+		lz4Length(out, count - 15);
+	out.insert(out.end(), literals, literals + count);
+	if(!match)
+		return;
+	out.push_back(offset & 0xFF);
+	out.push_back(offset >> 8);
+	if(extra >= 15)
+		lz4Length(out, extra - 15);
+}
+
+// One LZ4 block (no frame around it). Greedy: the last place each 4 bytes
+// were seen is kept in a hash table, and a match is taken as soon as one is
+// found. Skips ahead faster the longer it goes without a match, so noise
+// costs little time.
+void lz4Block(const uint8_t * in, size_t n, std::vector<uint8_t>& out){
+	std::vector<int32_t> table(1 << LZ4_HASH_BITS, -1);
+	size_t anchor = 0, i = 0, misses = 0;
+	size_t limit = (n > LZ4_MATCH_LIMIT ? n - LZ4_MATCH_LIMIT : 0);
+	while(i < limit){
+		uint32_t bytes;
+		memcpy(&bytes, in + i, 4);
+		uint32_t hash = (bytes*2654435761u) >> (32 - LZ4_HASH_BITS);
+		int32_t candidate = table[hash];
+		table[hash] = i;
+		if(candidate < 0 || i - candidate > LZ4_MAX_OFFSET || memcmp(in + candidate, in + i, 4) != 0){
+			i += 1 + (misses++ >> 6);
+			continue;
+		}
+		misses = 0;
+
+		size_t match = LZ4_MIN_MATCH, end = n - LZ4_LAST_LITERALS;
+		while(i + match < end && in[candidate + match] == in[i + match])
+			match++;
+		lz4Sequence(out, in + anchor, i - anchor, i - candidate, match);
+		i += match;
+		anchor = i;
+	}
+	lz4Sequence(out, in + anchor, n - anchor, 0, 0);
+}
+
+// The header checksum byte of an LZ4 frame: the second byte of the xxHash32
+// (seed 0) of the frame descriptor. Only descriptors (under 16 bytes) are
+// hashed here, so only that path of xxHash32 is needed.
+uint8_t lz4HeaderChecksum(const uint8_t * descriptor, int n){
+	const uint32_t PRIME1 = 2654435761u, PRIME2 = 2246822519u, PRIME3 = 3266489917u, PRIME4 = 668265263u, PRIME5 = 374761393u;
+	auto rotate = [](uint32_t v, int r){return (v << r) | (v >> (32 - r));};
+	uint32_t h = PRIME5 + n;
+	int i = 0;
+	for(; i + 4 <= n; i += 4){
+		uint32_t word;
+		memcpy(&word, descriptor + i, 4);
+		h = rotate(h + word*PRIME3, 17)*PRIME4;
+	}
+	for(; i < n; i++){
+		h = rotate(h + descriptor[i]*PRIME5, 11)*PRIME1;
+	}
+	h ^= h >> 15;
+	h *= PRIME2;
+	h ^= h >> 13;
+	h *= PRIME3;
+	h ^= h >> 16;
+	return (h >> 8) & 0xFF;
+}
+
+#endif // COMPRESS_H
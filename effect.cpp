@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <iostream>
+#include <string.h>
 #include <EIGEN_SETTINGS.h>
 
 #include "comp.h"
@@ -8,10 +9,19 @@
 #include "line.h"
 #include "keyframe.h"
 #include "tri.h"
+#include "preview.h"
+#include "footage.h"
+#include "text.h"
+#include "particles.h"
+#include "path.h"
 
 
 
 int main(int argc, char ** argv){
+	if(argc > 1 && strcmp(argv[1], "bench-easing") == 0){
+		benchmarkEasing();
+		return 0;
+	}
 
 	/*
 	Comp comp(100, 100, 30);
@@ -20,7 +30,5 @@ int main(int argc, char ** argv){
 	
 	comp.addLayer(shapes);
 
-	renderCompToFolder(&comp, 0, 2, "output");
-	
-	delete shapes;*/
+	renderCompToFolder(&comp, 0, 2, "output");*/
 }
\ No newline at end of file
@@ -0,0 +1,345 @@
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+#include <EIGEN_SETTINGS.h>
+#include "image_buffer.h"
+#include "simd.h"
+#include "parallel.h"
+
+// Per layer effects. They run in place on the layer's buffer after it has been
+// rendered and before it is composited. An effect that reads neighbouring
+// pixels declares how far through getMargin(); the compositor renders the layer
+// that much larger on every side, so every pixel it keeps saw real neighbours.
+// Pixels outside the buffer count as transparent.
+
+#define EFFECT_STRIP_WIDTH 16
+
+class Effect{
+public:
+	virtual ~Effect(){}
+
+	// Pixels beyond the kept region this effect reads from
+	virtual int getMargin(float frame_num){return 0;}
+
+	virtual void apply(const ImageView& buffer, float frame_num) = 0;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////BOX FILTERS//////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Box filters are running sums, so their cost doesn't depend on the radius.
+// Sums are kept in double: a band rendered with a different buffer origin
+// accumulates in a different order, and double keeps that from showing up in
+// the float result.
+
+// One pass of radius r along every row
+void boxBlurRows(const ImageView& buffer, int r){
+	if(r <= 0 || buffer.isEmpty())
+		return;
+
+	int width = buffer.getWidth();
+	double4 scale(1.0/(2*r + 1));
+	parallelFor(buffer.getY0(), buffer.getY1(), 8, [&](int begin, int end){
+		std::vector<float4> line(width);
+		for(int y = begin; y < end; y++){
+			Pixel * row = buffer.row(y);
+			for(int x = 0; x < width; x++){
+				line[x] = row[x].toFloat4();
+			}
+
+			double4 sum(0.0);
+			for(int x = 0; x <= r && x < width; x++){
+				sum = sum + double4(line[x]);
+			}
+			for(int x = 0; x < width; x++){
+				row[x].set((sum*scale).toFloat4());
+				if(x + r + 1 < width)
+					sum = sum + double4(line[x + r + 1]);
+				if(x - r >= 0)
+					sum = sum - double4(line[x - r]);
+			}
+		}
+	});
+}
+
+// One pass of radius r along every column, EFFECT_STRIP_WIDTH columns at a time
+// so that rows are read contiguously
+void boxBlurColumns(const ImageView& buffer, int r){
+	if(r <= 0 || buffer.isEmpty())
+		return;
+
+	int width = buffer.getWidth(), height = buffer.getHeight();
+	int strips = (width + EFFECT_STRIP_WIDTH - 1)/EFFECT_STRIP_WIDTH;
+	double4 scale(1.0/(2*r + 1));
+	parallelFor(0, strips, 1, [&](int begin, int end){
+		std::vector<float4> strip((size_t)height*EFFECT_STRIP_WIDTH);
+		double4 sums[EFFECT_STRIP_WIDTH];
+		for(int s = begin; s < end; s++){
+			int x0 = s*EFFECT_STRIP_WIDTH;
+			int columns = std::min(EFFECT_STRIP_WIDTH, width - x0);
+
+			for(int y = 0; y < height; y++){
+				Pixel * row = buffer.row(buffer.getY0() + y) + x0;
+				for(int c = 0; c < columns; c++){
+					strip[y*EFFECT_STRIP_WIDTH + c] = row[c].toFloat4();
+				}
+			}
+
+			for(int c = 0; c < columns; c++){
+				sums[c] = double4(0.0);
+			}
+			for(int y = 0; y <= r && y < height; y++){
+				for(int c = 0; c < columns; c++){
+					sums[c] = sums[c] + double4(strip[y*EFFECT_STRIP_WIDTH + c]);
+				}
+			}
+
+			for(int y = 0; y < height; y++){
+				Pixel * row = buffer.row(buffer.getY0() + y) + x0;
+				for(int c = 0; c < columns; c++){
+					row[c].set((sums[c]*scale).toFloat4());
+					if(y + r + 1 < height)
+						sums[c] = sums[c] + double4(strip[(y + r + 1)*EFFECT_STRIP_WIDTH + c]);
+					if(y - r >= 0)
+						sums[c] = sums[c] - double4(strip[(y - r)*EFFECT_STRIP_WIDTH + c]);
+				}
+			}
+		}
+	});
+}
+
+// Radii of three box passes approximating a Gaussian of sigma
+// (Kovesi, "Fast almost-Gaussian filtering", 2010)
+void gaussianBoxRadii(float sigma, int radii[3]){
+	const int passes = 3;
+	float ideal = sqrt(12*sigma*sigma/passes + 1);
+	int lower = (int)ideal;
+	if(lower%2 == 0)
+		lower--;
+	int upper = lower + 2;
+	int m = (int)round((12*sigma*sigma - passes*lower*lower - 4*passes*lower - 3*passes)/(-4.0f*lower - 4));
+	for(int i = 0; i < passes; i++){
+		radii[i] = std::max(0, ((i < m ? lower : upper) - 1)/2);
+	}
+}
+
+void gaussianBlur(const ImageView& buffer, float sigma_x, float sigma_y){
+	int rx[3], ry[3];
+	gaussianBoxRadii(sigma_x, rx);
+	gaussianBoxRadii(sigma_y, ry);
+	for(int i = 0; i < 3; i++){
+		boxBlurRows(buffer, rx[i]);
+	}
+	for(int i = 0; i < 3; i++){
+		boxBlurColumns(buffer, ry[i]);
+	}
+}
+
+int gaussianMargin(float sigma){
+	int radii[3];
+	gaussianBoxRadii(sigma, radii);
+	return radii[0] + radii[1] + radii[2];
+}
+
+// Buffer with the same size and placement as view, holding a copy of its pixels
+ImageView copyOf(const ImageView& view, ImageBuffer& storage){
+	storage = ImageBuffer(view.getWidth(), view.getHeight());
+	ImageView copy = storage.view().placed(view.getX0(), view.getY0(), view.getFrameWidth(), view.getFrameHeight());
+	parallelFor(view.getY0(), view.getY1(), 32, [&](int begin, int end){
+		for(int y = begin; y < end; y++){
+			memcpy(copy.row(y), view.row(y), view.getWidth()*sizeof(Pixel));
+		}
+	});
+	return copy;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////EFFECTS////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class BoxBlur : public Effect{
+	int _radius_x, _radius_y, _passes;
+public:
+	BoxBlur(int radius_x, int radius_y, int passes = 1): _radius_x(radius_x), _radius_y(radius_y), _passes(passes){}
+
+	int getMargin(float frame_num){return std::max(_radius_x, _radius_y)*_passes;}
+
+	void apply(const ImageView& buffer, float frame_num){
+		for(int i = 0; i < _passes; i++){
+			boxBlurRows(buffer, _radius_x);
+			boxBlurColumns(buffer, _radius_y);
+		}
+	}
+};
+
+class GaussianBlur : public Effect{
+	float _sigma_x, _sigma_y;
+public:
+	GaussianBlur(float sigma): _sigma_x(sigma), _sigma_y(sigma){}
+	GaussianBlur(float sigma_x, float sigma_y): _sigma_x(sigma_x), _sigma_y(sigma_y){}
+
+	int getMargin(float frame_num){return std::max(gaussianMargin(_sigma_x), gaussianMargin(_sigma_y));}
+
+	void apply(const ImageView& buffer, float frame_num){
+		gaussianBlur(buffer, _sigma_x, _sigma_y);
+	}
+};
+
+// Adds a blurred copy of the parts brighter than threshold back on top
+class Glow : public Effect{
+	float _sigma, _threshold, _intensity;
+public:
+	Glow(float sigma, float threshold, float intensity): _sigma(sigma), _threshold(threshold), _intensity(intensity){}
+
+	int getMargin(float frame_num){return gaussianMargin(_sigma);}
+
+	void apply(const ImageView& buffer, float frame_num){
+		ImageBuffer storage;
+		ImageView glow = copyOf(buffer, storage);
+
+		parallelFor(glow.getY0(), glow.getY1(), 32, [&](int begin, int end){
+			for(int y = begin; y < end; y++){
+				Pixel * row = glow.row(y);
+				for(int x = 0; x < glow.getWidth(); x++){
+					Pixel& p = row[x];
+					float luma = 0.2126f*p.getR() + 0.7152f*p.getG() + 0.0722f*p.getB();
+					if(luma < _threshold*p.getA())
+						p.set(0, 0, 0, 0);
+				}
+			}
+		});
+
+		gaussianBlur(glow, _sigma, _sigma);
+
+		float4 intensity(_intensity);
+		static const float colourOnly[4] = {1, 1, 1, 0};
+		float4 mask = float4::load(colourOnly);
+		parallelFor(buffer.getY0(), buffer.getY1(), 32, [&](int begin, int end){
+			for(int y = begin; y < end; y++){
+				Pixel * row = buffer.row(y);
+				Pixel * add = glow.row(y);
+				for(int x = 0; x < buffer.getWidth(); x++){
+					float4 g = add[x].toFloat4()*intensity;
+					// Glow brings its own coverage where the layer had none
+					float4 p = row[x].toFloat4();
+					float4 alpha = min(p.splatW() + g.splatW()*(float4(1.0f) - p.splatW()), float4(1.0f));
+					row[x].set(p + g*mask + (alpha - p.splatW())*(float4(1.0f) - mask));
+				}
+			}
+		});
+	}
+};
+
+// Unsharp mask: pushes each pixel away from a blurred copy of itself
+class Sharpen : public Effect{
+	float _amount, _sigma;
+public:
+	Sharpen(float amount, float sigma = 1.0f): _amount(amount), _sigma(sigma){}
+
+	int getMargin(float frame_num){return gaussianMargin(_sigma);}
+
+	void apply(const ImageView& buffer, float frame_num){
+		ImageBuffer storage;
+		ImageView blurred = copyOf(buffer, storage);
+		gaussianBlur(blurred, _sigma, _sigma);
+
+		float4 amount(_amount), zero(0.0f);
+		static const float colourOnly[4] = {1, 1, 1, 0};
+		float4 mask = float4::load(colourOnly);
+		parallelFor(buffer.getY0(), buffer.getY1(), 32, [&](int begin, int end){
+			for(int y = begin; y < end; y++){
+				Pixel * row = buffer.row(y);
+				Pixel * blur = blurred.row(y);
+				for(int x = 0; x < buffer.getWidth(); x++){
+					float4 p = row[x].toFloat4();
+					float4 sharp = max(p + (p - blur[x].toFloat4())*amount, zero);
+					// Coverage is left alone and premultiplied colour kept within it
+					row[x].set(min(sharp, p.splatW())*mask + p*(float4(1.0f) - mask));
+				}
+			}
+		});
+	}
+};
+
+// rgb' = M*rgb + offset, on unpremultiplied colour. Alpha is left alone.
+class ColourMatrix : public Effect{
+	float _m[3][4]; // Row per output channel: r, g, b weights then offset
+public:
+	ColourMatrix(const float m[3][4]){
+		memcpy(_m, m, sizeof(_m));
+	}
+
+	static ColourMatrix saturation(float s){
+		// Rec.709 luma weights
+		float lr = 0.2126f*(1 - s), lg = 0.7152f*(1 - s), lb = 0.0722f*(1 - s);
+		float m[3][4] = {
+			{lr + s, lg, lb, 0},
+			{lr, lg + s, lb, 0},
+			{lr, lg, lb + s, 0}
+		};
+		return ColourMatrix(m);
+	}
+
+	void apply(const ImageView& buffer, float frame_num){
+		parallelFor(buffer.getY0(), buffer.getY1(), 32, [&](int begin, int end){
+			for(int y = begin; y < end; y++){
+				Pixel * row = buffer.row(y);
+				for(int x = 0; x < buffer.getWidth(); x++){
+					Pixel& p = row[x];
+					// On premultiplied colour the linear part is unchanged and the offset scales by alpha
+					float r = p.getR(), g = p.getG(), b = p.getB(), a = p.getA();
+					p.set(_m[0][0]*r + _m[0][1]*g + _m[0][2]*b + _m[0][3]*a,
+						_m[1][0]*r + _m[1][1]*g + _m[1][2]*b + _m[1][3]*a,
+						_m[2][0]*r + _m[2][1]*g + _m[2][2]*b + _m[2][3]*a, a);
+				}
+			}
+		});
+	}
+};
+
+// Input black/white point, gamma, then output black/white point, on unpremultiplied colour
+class Levels : public Effect{
+	float _in_black, _in_white, _gamma, _out_black, _out_white;
+	std::vector<float> _lut;
+
+	float level(float v){
+		v = clamp(0, 1, (v - _in_black)/(_in_white - _in_black));
+		return _out_black + pow(v, 1/_gamma)*(_out_white - _out_black);
+	}
+
+public:
+	Levels(float in_black, float in_white, float gamma, float out_black = 0, float out_white = 1):
+		_in_black(in_black), _in_white(in_white), _gamma(gamma), _out_black(out_black), _out_white(out_white){
+		// Same LUT layout as TransferLUT
+		_lut.resize(TRANSFER_LUT_SIZE + 2);
+		for(int i = 0; i <= TRANSFER_LUT_SIZE; i++){
+			_lut[i] = level((float)i/TRANSFER_LUT_SIZE);
+		}
+		_lut[TRANSFER_LUT_SIZE + 1] = _lut[TRANSFER_LUT_SIZE];
+	}
+
+	void apply(const ImageView& buffer, float frame_num){
+		parallelFor(buffer.getY0(), buffer.getY1(), 32, [&](int begin, int end){
+			for(int y = begin; y < end; y++){
+				Pixel * row = buffer.row(y);
+				for(int x = 0; x < buffer.getWidth(); x++){
+					Pixel& p = row[x];
+					float a = p.getA();
+					if(a <= 0)
+						continue;
+
+					float c[3] = {p.getR()/a, p.getG()/a, p.getB()/a};
+					for(int i = 0; i < 3; i++){
+						float index = clamp(0, 1, c[i])*TRANSFER_LUT_SIZE;
+						int base = (int)index;
+						c[i] = _lut[base] + (index - base)*(_lut[base + 1] - _lut[base]);
+					}
+					p.set(c[0]*a, c[1]*a, c[2]*a, a);
+				}
+			}
+		});
+	}
+};
+
+#endif // EFFECTS_H
@@ -0,0 +1,261 @@
+#ifndef FOOTAGE_H
+#define FOOTAGE_H
+
+#include <EIGEN_SETTINGS.h>
+#include <stdio.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "layer.h"
+#include "keyframe.h"
+
+// Plays back a numbered TIFF sequence, e.g. "output/%04i.tif" as written by
+// renderCompToFolder. Frame (0, 0) of each image lands on layer pixel (0, 0),
+// unscaled; use the layer transform to place it.
+//
+// Decoding happens on I/O threads. Each render asks for the source frame it
+// needs and the ones the next few comp frames will need, nearest first, so by
+// the time the comp gets to a frame it is usually already decoded. Decoded
+// frames are kept in a bounded cache; the least recently used ones that no
+// upcoming frame needs go first, also when the memory budget runs low.
+class Footage : public Layer, public MemoryEvictor{
+	struct CachedFrame{
+		std::shared_ptr<ImageBuffer> image; // Null if the file couldn't be read
+		unsigned last_used;
+	};
+
+	std::string _pattern;
+	int _first_frame, _end_frame; // Source frames [first, end)
+	float _start_frame;           // Comp frame that shows _first_frame
+	float _source_rate, _comp_rate;
+	Float_Animator * _time_remap = nullptr; // Not owned
+
+	int _read_ahead, _cache_frames;
+
+	std::mutex _mutex;
+	std::condition_variable _wake, _loaded;
+	std::map<int, CachedFrame> _frames;
+	std::deque<int> _queue;  // Waiting for an I/O thread, most wanted first
+	std::set<int> _loading;  // Being decoded
+	std::set<int> _wanted;   // Needed by the latest fetch() and its upcoming comp frames
+	std::multiset<int> _live; // The same for every fetch() still waiting
+	unsigned _clock;
+	bool _quit;
+	std::vector<std::thread> _io;
+
+	bool isRequested(int source){
+		return _frames.count(source) || _loading.count(source) || std::find(_queue.begin(), _queue.end(), source) != _queue.end();
+	}
+
+	bool isWanted(int source){
+		return _wanted.count(source) || _live.count(source);
+	}
+
+	// Drops the least recently used frame nothing upcoming needs, returning the
+	// bytes that frees, or -1 if there isn't one. Frames a render still holds
+	// are left alone, dropping them wouldn't free anything yet. Lock held.
+	long evictOne(){
+		auto victim = _frames.end();
+		for(auto it = _frames.begin(); it != _frames.end(); ++it){
+			if(isWanted(it->first) || it->second.image.use_count() > 1)
+				continue;
+			if(victim == _frames.end() || it->second.last_used < victim->second.last_used)
+				victim = it;
+		}
+		if(victim == _frames.end())
+			return -1;
+
+		long bytes = (victim->second.image ? victim->second.image->getBytes() : 0);
+		_frames.erase(victim);
+		return bytes;
+	}
+
+	// Lock held
+	void evict(){
+		while(_frames.size() > _cache_frames && evictOne() >= 0){}
+	}
+
+	void ioLoop(){
+		std::unique_lock<std::mutex> lock(_mutex);
+		while(true){
+			_wake.wait(lock, [&]{return _quit || !_queue.empty();});
+			if(_quit)
+				return;
+
+			int source = _queue.front();
+			_queue.pop_front();
+			_loading.insert(source);
+			lock.unlock();
+
+			char name[1024];
+			snprintf(name, sizeof(name), _pattern.c_str(), source);
+			std::shared_ptr<ImageBuffer> image(new ImageBuffer());
+			if(!image->load(name, false, MEM_CACHES)){
+				ERROR("ERROR - FOOTAGE - Could not read frame " << source << " from " << name);
+				image.reset();
+			}
+
+			lock.lock();
+			_loading.erase(source);
+			CachedFrame& cached = _frames[source];
+			cached.image = image;
+			cached.last_used = _clock;
+			evict();
+			_loaded.notify_all();
+		}
+	}
+
+	// Source frame for a comp frame, held at the ends of the sequence
+	int sourceFrame(float frame_num){
+		float t;
+		if(_time_remap)
+			t = _time_remap->interpolate(frame_num);
+		else
+			t = _first_frame + (frame_num - _start_frame)*_source_rate/_comp_rate;
+		// A small nudge so that exact ratios (e.g. 24 into 48) don't round down a frame
+		int source = (int)std::floor(t + 1e-4f);
+		return std::max(_first_frame, std::min(source, _end_frame - 1));
+	}
+
+	// Decoded source frame, waiting for it if it isn't ready. Also queues up the
+	// frames the next read_ahead comp frames need. Safe to call from several
+	// threads at once (e.g. a render and a preview); what one call asks for
+	// stays wanted until it has returned.
+	std::shared_ptr<ImageBuffer> fetch(float frame_num){
+		std::vector<int> window(1, sourceFrame(frame_num));
+		for(int i = 1; i <= _read_ahead; i++){
+			window.push_back(sourceFrame(frame_num + i));
+		}
+		int source = window[0];
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		_clock++;
+		_wanted.clear();
+		_wanted.insert(window.begin(), window.end());
+
+		// Requests that haven't started yet are redone in the new order: this
+		// frame, what other calls are waiting on, then this call's read ahead.
+		// Read ahead nobody wants any more is dropped.
+		std::deque<int> queue;
+		queue.swap(_queue);
+		if(!isRequested(source))
+			_queue.push_back(source);
+		for(int queued : queue){
+			if(queued != source && _live.count(queued))
+				_queue.push_back(queued);
+		}
+		for(int i = 1; i < window.size(); i++){
+			if(!isRequested(window[i]))
+				_queue.push_back(window[i]);
+		}
+		_live.insert(window.begin(), window.end());
+		_wake.notify_all();
+
+		// Asked for again if it went (evicted, or the queue was redone) before
+		// this call got to it
+		while(!_frames.count(source)){
+			if(!isRequested(source)){
+				_queue.push_front(source);
+				_wake.notify_one();
+			}
+			_loaded.wait(lock);
+		}
+		for(int frame : window){
+			_live.erase(_live.find(frame));
+		}
+
+		CachedFrame& cached = _frames[source];
+		cached.last_used = _clock;
+		return cached.image;
+	}
+
+public:
+	// Source frames [first_frame, end_frame) of pattern (a printf pattern taking the
+	// frame number), shot at source_rate and played in a comp running at
+	// comp_rate. Keeps up to cache_frames decoded, reading read_ahead comp
+	// frames ahead on io_threads threads.
+	Footage(const std::string& pattern, int first_frame, int end_frame, float source_rate, float comp_rate,
+		int read_ahead = 8, int cache_frames = 24, int io_threads = 2):
+		_pattern(pattern), _first_frame(first_frame), _end_frame(end_frame), _start_frame(0),
+		_source_rate(source_rate), _comp_rate(comp_rate), _read_ahead(read_ahead),
+		_cache_frames(cache_frames), _clock(0), _quit(false){
+		if(end_frame <= first_frame){
+			ERROR("ERROR - FOOTAGE - Need at least 1 frame in " << pattern << " ...bailing");
+			exit(0);
+		}
+		if(_cache_frames < _read_ahead + 1){
+			ERROR("ERROR - FOOTAGE - Cache of " << _cache_frames << " frames can't hold " << _read_ahead << " frames of read ahead, growing it");
+			_cache_frames = _read_ahead + 1;
+		}
+
+		for(int i = 0; i < std::max(1, io_threads); i++){
+			_io.push_back(std::thread(&Footage::ioLoop, this));
+		}
+		memoryTracker().addEvictor(this);
+	}
+
+	~Footage(){
+		memoryTracker().removeEvictor(this);
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_wake.notify_all();
+		for(int i = 0; i < _io.size(); i++){
+			_io[i].join();
+		}
+	}
+
+	// Comp frame the first source frame plays at
+	void setStartFrame(float start_frame){_start_frame = start_frame;}
+
+	// Source frame to show for each comp frame, replacing the frame rate mapping.
+	// Not owned.
+	void setTimeRemap(Float_Animator * source_frame){_time_remap = source_frame;}
+
+	int getSourceFrame(float frame_num){return sourceFrame(frame_num);}
+
+	size_t releaseMemory(size_t bytes){
+		std::lock_guard<std::mutex> lock(_mutex);
+		size_t released = 0;
+		while(released < bytes){
+			long freed = evictOne();
+			if(freed < 0)
+				break;
+			released += freed;
+		}
+		return released;
+	}
+
+	bool tracksWrites(){return true;}
+
+	void render(const ImageView& target, float frame_num, const TileMask * coverage = nullptr){
+		std::shared_ptr<ImageBuffer> image = fetch(frame_num);
+		if(!image)
+			return;
+
+		ImageView source = image->view();
+		ImageView region = target.sub(0, 0, source.getWidth(), source.getHeight());
+		if(region.isEmpty())
+			return;
+
+		auto copySpan = [&](int y, int x0, int x1){
+			memcpy(region.row(y) + (x0 - region.getX0()), source.row(y) + x0, (x1 - x0)*sizeof(Pixel));
+		};
+		parallelFor(region.getY0(), region.getY1(), 32, [&](int begin, int end){
+			for(int y = begin; y < end; y++){
+				if(coverage)
+					coverage->forEachRun(y, region.getX0(), region.getX1(), [&](int x0, int x1){copySpan(y, x0, x1);});
+				else
+					copySpan(y, region.getX0(), region.getX1());
+			}
+		});
+		target.markWritten(region.getX0(), region.getY0(), region.getX1(), region.getY1());
+	}
+};
+
+#endif // FOOTAGE_H
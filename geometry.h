@@ -0,0 +1,19 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <EIGEN_SETTINGS.h>
+
+class Geometry{
+	
+public:
+	Geometry(){
+
+	}
+	virtual ~Geometry(){}
+	virtual bool getColor(const VEC2& pos, VEC3 * col_out) = 0;
+
+	// Box holding every point getColor() can hit, false if there isn't one
+	virtual bool getBounds(VEC2& min_out, VEC2& max_out){return false;}
+};
+
+#endif // GEOMETRY_H
@@ -0,0 +1,84 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// 64 bit hash of a block of memory, for telling whether two output frames are
+// the same. Not cryptographic. Input is taken 32 bytes at a time in 4 lanes:
+// each 8 bytes are added in along with the product of their two halves mixed
+// with a key that changes every block, so the same bytes in a different place
+// hash differently. With AVX2 a block is one multiply; without, the same sums
+// are done lane by lane and give the same hash.
+
+#define HASH_KEY_STEP 0x9E3779B97F4A7C15ULL
+
+static const uint64_t HASH_KEYS[4] = {0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL};
+
+inline uint64_t hashMix(uint64_t h){
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+inline void hashLanes(uint64_t acc[4], uint64_t key[4], const uint8_t * block){
+	for(int i = 0; i < 4; i++){
+		uint64_t d;
+		memcpy(&d, block + i*8, 8);
+		uint64_t dk = d ^ key[i];
+		acc[i] += d + (uint64_t)(uint32_t)dk*(dk >> 32);
+		key[i] += HASH_KEY_STEP;
+	}
+}
+
+uint64_t hashBytes(const void * data, size_t bytes, uint64_t seed = 0){
+	const uint8_t * p = (const uint8_t *)data;
+	size_t blocks = bytes/32;
+	uint64_t acc[4], key[4];
+	for(int i = 0; i < 4; i++){
+		acc[i] = seed + i;
+		key[i] = HASH_KEYS[i];
+	}
+
+#ifdef __AVX2__
+	__m256i vacc = _mm256_loadu_si256((const __m256i *)acc);
+	__m256i vkey = _mm256_loadu_si256((const __m256i *)key);
+	__m256i step = _mm256_set1_epi64x((long long)HASH_KEY_STEP);
+	for(size_t b = 0; b < blocks; b++){
+		__m256i d = _mm256_loadu_si256((const __m256i *)(p + b*32));
+		__m256i dk = _mm256_xor_si256(d, vkey);
+		__m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+		vacc = _mm256_add_epi64(vacc, _mm256_add_epi64(d, product));
+		vkey = _mm256_add_epi64(vkey, step);
+	}
+	_mm256_storeu_si256((__m256i *)acc, vacc);
+	_mm256_storeu_si256((__m256i *)key, vkey);
+#else
+	for(size_t b = 0; b < blocks; b++){
+		hashLanes(acc, key, p + b*32);
+	}
+#endif
+
+	// Last partial block, zero padded
+	size_t rest = bytes - blocks*32;
+	if(rest > 0){
+		uint8_t last[32] = {0};
+		memcpy(last, p + blocks*32, rest);
+		hashLanes(acc, key, last);
+	}
+
+	uint64_t h = hashMix(seed ^ (bytes*HASH_KEY_STEP));
+	for(int i = 0; i < 4; i++){
+		h = hashMix(h ^ hashMix(acc[i]));
+	}
+	return h;
+}
+
+#endif // HASH_H
@@ -2,109 +2,324 @@
 #define IMAGE_BUFFER_H
 
 #include "pixel.h"
+#include "quantize.h"
+#include "tiles.h"
+#include "memory.h"
+#include "tiff_writer.h"
 #include <EIGEN_SETTINGS.h>
+#include <stdlib.h>
+#include <algorithm>
 
+// Rows start on this byte boundary, so every row is cache line (and AVX) aligned
+#define BUFFER_ALIGNMENT 64
+
+// Non-owning window onto a rectangle of pixels. Coordinates are in frame space:
+// the view covers frame pixels [x0, x0+width) x [y0, y0+height) of a frame that
+// is frameWidth x frameHeight. Views are cheap to copy and never free anything,
+// and views over disjoint rectangles of one buffer can be written concurrently.
+//
+// A view can also carry a TileMask that writers mark the tiles they touch in
+// (markWritten), so whoever owns the buffer knows which tiles hold anything.
+// Marking is not thread safe; code that writes from several threads marks
+// once, before or after.
+class ImageView{
+	Pixel * _pixels; // Pixel at (_x0, _y0)
+	int _x0, _y0;
+	int _width, _height;
+	int _stride; // In pixels
+	int _frameWidth, _frameHeight;
+	TileMask * _written;
+public:
+	ImageView(): _pixels(nullptr), _x0(0), _y0(0), _width(0), _height(0), _stride(0), _frameWidth(0), _frameHeight(0), _written(nullptr){}
+
+	ImageView(Pixel * pixels, int x0, int y0, int width, int height, int stride, int frameWidth, int frameHeight, TileMask * written = nullptr):
+		_pixels(pixels), _x0(x0), _y0(y0), _width(width), _height(height), _stride(stride),
+		_frameWidth(frameWidth), _frameHeight(frameHeight), _written(written){}
+
+	int getX0() const {return _x0;}
+	int getY0() const {return _y0;}
+	int getX1() const {return _x0 + _width;}
+	int getY1() const {return _y0 + _height;}
+	int getWidth() const {return _width;}
+	int getHeight() const {return _height;}
+	int getStride() const {return _stride;}
+	int getFrameWidth() const {return _frameWidth;}
+	int getFrameHeight() const {return _frameHeight;}
+	bool isEmpty() const {return _width <= 0 || _height <= 0;}
+
+	void getDimensions(int& x, int& y) const {
+		x = _width;
+		y = _height;
+	}
+
+	bool contains(int x, int y) const {
+		return x >= _x0 && x < _x0 + _width && y >= _y0 && y < _y0 + _height;
+	}
+
+	// First pixel of frame row y, i.e. the pixel at (getX0(), y)
+	Pixel * row(int y) const {
+		return _pixels + (ptrdiff_t)(y - _y0)*_stride;
+	}
+
+	Pixel * getPixel(int x, int y) const {
+		if(!contains(x, y)){
+			ERROR("ERROR - IMAGE_VIEW - Can not get pixel (" << x << ", " << y << ") in ImageView [" << _x0 << ", " << _y0 << "] " << _width << "x" << _height);
+			return nullptr;
+		}
+
+		return row(y) + (x - _x0);
+	}
+
+	// The part of this view inside the frame space rectangle, possibly empty
+	ImageView sub(int x, int y, int width, int height) const {
+		int x0 = std::max(x, _x0);
+		int y0 = std::max(y, _y0);
+		int x1 = std::min(x + width, _x0 + _width);
+		int y1 = std::min(y + height, _y0 + _height);
+		if(x1 <= x0 || y1 <= y0)
+			return ImageView(_pixels, _x0, _y0, 0, 0, _stride, _frameWidth, _frameHeight, _written);
+
+		return ImageView(row(y0) + (x0 - _x0), x0, y0, x1 - x0, y1 - y0, _stride, _frameWidth, _frameHeight, _written);
+	}
+
+	// Same view, marking the tiles it is written in into written
+	ImageView tracking(TileMask * written) const {
+		return ImageView(_pixels, _x0, _y0, _width, _height, _stride, _frameWidth, _frameHeight, written);
+	}
+
+	bool isTracking() const {return _written != nullptr;}
+
+	// Records that the frame space rectangle [x0, x1) x [y0, y1) (clipped to the view) was written
+	void markWritten(int x0, int y0, int x1, int y1) const {
+		if(_written)
+			_written->setRect(std::max(x0, _x0), std::max(y0, _y0), std::min(x1, getX1()), std::min(y1, getY1()));
+	}
+
+	void markWritten(const TileMask& tiles) const {
+		if(_written)
+			_written->merge(tiles);
+	}
+
+	// Same pixels, placed at a different position in a (possibly different) frame.
+	// Used to hand a band or tile sized scratch buffer to code that works in frame space.
+	// The result doesn't track writes, tiles don't line up across placements.
+	ImageView placed(int x0, int y0, int frameWidth, int frameHeight) const {
+		return ImageView(_pixels, x0, y0, _width, _height, _stride, frameWidth, frameHeight);
+	}
+
+	void fill(const Pixel& value) const {
+		for(int y = _y0; y < _y0 + _height; y++){
+			Pixel * r = row(y);
+			for(int x = 0; x < _width; x++){
+				r[x] = value;
+			}
+		}
+	}
+
+	void clear() const {
+		fill(Pixel());
+	}
+};
+
+// Writes packed RGB from quantizeRows() as a frame file: a TIFF, or with LZ4
+// compression a raw .lz4 file. Compressed strips are compressed in parallel.
+bool writeQuantizedFrame(const std::string& filename, const void * pixels, int width, int height, const OutputFormat& format){
+	if(format.compression != COMPRESS_NONE){
+		std::unique_ptr<StripWriter> writer(newStripWriter(format.compression));
+		int rowBytes = width*3*format.bytesPerSample();
+		if(!writer->open(filename, width, height, format.bits, stripRows(rowBytes, height), format.compression))
+			return false;
+		writer->writeStrips(pixels, height);
+		if(!writer->close())
+			return false;
+		PRINT("Wrote file " << filename << " successfully");
+		return true;
+	}
+
+	TinyTIFFWriterFile * tiffw = TinyTIFFWriter_open(filename.c_str(), format.bits, TinyTIFFWriter_UInt, 3, width, height, TinyTIFFWriter_RGB);
+	if(!tiffw){
+		ERROR("ERROR - IMAGE_BUFFER - Could not open " << filename << " for writing");
+		return false;
+	}
+
+	TinyTIFFWriter_writeImage(tiffw, pixels);
+	TinyTIFFWriter_close(tiffw);
+
+	PRINT("Wrote file " << filename << " successfully");
+	return true;
+}
+
+// Owning, aligned pixel storage. Move-only: buffers are handed around by
+// reference, pointer or view, never copied by accident. Storage is tracked
+// under the buffer's memory category.
 class ImageBuffer{
 	int _xRes, _yRes;
+	int _stride; // In pixels, >= _xRes
 	Pixel * _pixels;
+	MemoryCategory _category;
+
+	void allocate(int xRes, int yRes){
+		_xRes = xRes;
+		_yRes = yRes;
+		int perLine = BUFFER_ALIGNMENT/sizeof(Pixel);
+		_stride = (xRes + perLine - 1)/perLine*perLine;
+		_pixels = nullptr;
+		size_t bytes = (size_t)_stride*_yRes*sizeof(Pixel);
+		if(bytes == 0)
+			return;
+
+		_pixels = (Pixel *)trackedAlloc(bytes, _category, BUFFER_ALIGNMENT);
+		view().clear();
+	}
+
+	void release(){
+		trackedFree(_pixels, getBytes(), _category);
+		_pixels = nullptr;
+	}
+
 public:
+	ImageBuffer(): _xRes(0), _yRes(0), _stride(0), _pixels(nullptr), _category(MEM_FRAMEBUFFERS){}
+
+	ImageBuffer(const ImageBuffer&) = delete;
+	ImageBuffer& operator=(const ImageBuffer&) = delete;
+
+	ImageBuffer(ImageBuffer&& other): _xRes(other._xRes), _yRes(other._yRes), _stride(other._stride), _pixels(other._pixels), _category(other._category){
+		other._xRes = other._yRes = other._stride = 0;
+		other._pixels = nullptr;
+	}
+
+	ImageBuffer& operator=(ImageBuffer&& other){
+		if(this != &other){
+			release();
+			_xRes = other._xRes;
+			_yRes = other._yRes;
+			_stride = other._stride;
+			_pixels = other._pixels;
+			_category = other._category;
+			other._xRes = other._yRes = other._stride = 0;
+			other._pixels = nullptr;
+		}
+		return *this;
+	}
+
 	// Must be tiff
-	ImageBuffer(std::string filename){
+	// Reads a TIFF, bailing if it can't
+	ImageBuffer(std::string filename): _xRes(0), _yRes(0), _stride(0), _pixels(nullptr), _category(MEM_TEXTURES){
+		if(!load(filename)){
+			ERROR("...bailing");
+			exit(0);
+		}
+	}
+
+	// Replaces the contents with a TIFF. Returns false (leaving the buffer empty)
+	// if it can't be read, so callers that can carry on without it do.
+	bool load(const std::string& filename, bool verbose = true, MemoryCategory category = MEM_TEXTURES){
+		release();
+		_xRes = _yRes = _stride = 0;
+		_category = category;
+
 		TinyTIFFReaderFile * tif = TinyTIFFReader_open(filename.c_str());
 		if(!tif){
-			ERROR("Could not open file " << filename << " ...bailing");
-			exit(0);
+			ERROR("Could not open file " << filename);
+			return false;
 		}
 
 		uint32_t wwidth=TinyTIFFReader_getWidth(tif);
 		uint32_t hheight=TinyTIFFReader_getHeight(tif);
 		if(!(wwidth>0 && hheight>0)){
-			ERROR("File " << filename << " too small ...bailing");
-			exit(0);
+			ERROR("File " << filename << " too small");
+			TinyTIFFReader_close(tif);
+			return false;
 		}
 
-		_xRes = wwidth;
-		_yRes = hheight;
-		_pixels = new Pixel[_xRes*_yRes];
+		allocate(wwidth, hheight);
 
 		uint16_t sformat=TinyTIFFReader_getSampleFormat(tif);
-    uint16_t bits=TinyTIFFReader_getBitsPerSample(tif, 0); // Assume sample 0 is representative (it should be)
-    uint16_t samples = TinyTIFFReader_getSamplesPerPixel(tif);
-    PRINT("Reading file: " << filename);
-    PRINT("bits per sample = " << bits << ", sformat = " << sformat << ", Samples per pixel = " << samples);
-    for(uint16_t sample = 0; sample < samples; sample++){
-    	float * data = new float[_xRes*_yRes];
-
-    	if (sformat==TINYTIFF_SAMPLEFORMAT_UINT) {
-    		if (bits==8) TinyTIFFReader_readFrame<uint8_t, float>(tif, data, sample);
-    		else if (bits==16) TinyTIFFReader_readFrame<uint16_t, float>(tif, data, sample);
-    		else if (bits==32) TinyTIFFReader_readFrame<uint32_t, float>(tif, data, sample);
-    		else {
-    			ERROR("Could not read file: " << filename << " ...bailing");
-    			exit(0);
-    		}
-    	} else if (sformat==TINYTIFF_SAMPLEFORMAT_INT) {
-    		if (bits==8) TinyTIFFReader_readFrame<int8_t, float>(tif, data, sample);
-    		else if (bits==16) TinyTIFFReader_readFrame<int16_t, float>(tif, data, sample);
-    		else if (bits==32) TinyTIFFReader_readFrame<int32_t, float>(tif, data, sample);
-    		else {
-    			ERROR("Could not read file: " << filename << " ...bailing");
-    			exit(0);
-    		}
-    	} else if (sformat==TINYTIFF_SAMPLEFORMAT_FLOAT) {
-    		if (bits==32) TinyTIFFReader_readFrame<float, float>(tif, data, sample);
-    		else {
-    			ERROR("Could not read file: " << filename << " ...bailing");
-    			exit(0);
-    		}
-    	} else {
-    		ERROR("File " << filename << " has an unknown sformat ...bailing");
-    		exit(0);
-    	}
-
-
-    	float max = pow(2, bits) - 1;
-    	for(int y = 0; y < _yRes; y++){
-    		for(int x = 0; x < _xRes; x++){
-    			int index = y*_xRes+x;
-    			if(sample == 0){
-    				getPixel(x, y)->setR(data[index]/max);
-		    	}else if(sample == 1){
-		    		getPixel(x, y)->setG(data[index]/max);
-		    	}else if(sample == 2){
-		    		getPixel(x, y)->setB(data[index]/max);
-		    	}else if(sample == 3){
-		    		getPixel(x, y)->setA(data[index]/max);
-		    	}
-    		}
-    	}
-
-    	delete[] data;
-    }
-
-    if (TinyTIFFReader_wasError(tif)) {
-    	ERROR("Encountered an error:");
-    	ERROR(TinyTIFFReader_getLastError(tif));
-    	ERROR("...bailing");
-    	exit(0);
-    }
-
-    TinyTIFFReader_close(tif);
-    PRINT("file " << filename << " read successfully")
-	}
-
-	ImageBuffer(int xRes, int yRes): _xRes(xRes), _yRes(yRes){
-		_pixels = new Pixel[_xRes*_yRes]();
+		uint16_t bits=TinyTIFFReader_getBitsPerSample(tif, 0); // Assume sample 0 is representative (it should be)
+		uint16_t samples = TinyTIFFReader_getSamplesPerPixel(tif);
+		if(verbose){
+			PRINT("Reading file: " << filename);
+			PRINT("bits per sample = " << bits << ", sformat = " << sformat << ", Samples per pixel = " << samples);
+		}
+
+		bool ok = true;
+		float * data = new float[_xRes*_yRes];
+		for(uint16_t sample = 0; sample < samples && ok; sample++){
+			if (sformat==TINYTIFF_SAMPLEFORMAT_UINT) {
+				if (bits==8) TinyTIFFReader_readFrame<uint8_t, float>(tif, data, sample);
+				else if (bits==16) TinyTIFFReader_readFrame<uint16_t, float>(tif, data, sample);
+				else if (bits==32) TinyTIFFReader_readFrame<uint32_t, float>(tif, data, sample);
+				else {
+					ERROR("Could not read file: " << filename);
+					ok = false;
+				}
+			} else if (sformat==TINYTIFF_SAMPLEFORMAT_INT) {
+				if (bits==8) TinyTIFFReader_readFrame<int8_t, float>(tif, data, sample);
+				else if (bits==16) TinyTIFFReader_readFrame<int16_t, float>(tif, data, sample);
+				else if (bits==32) TinyTIFFReader_readFrame<int32_t, float>(tif, data, sample);
+				else {
+					ERROR("Could not read file: " << filename);
+					ok = false;
+				}
+			} else if (sformat==TINYTIFF_SAMPLEFORMAT_FLOAT) {
+				if (bits==32) TinyTIFFReader_readFrame<float, float>(tif, data, sample);
+				else {
+					ERROR("Could not read file: " << filename);
+					ok = false;
+				}
+			} else {
+				ERROR("File " << filename << " has an unknown sformat");
+				ok = false;
+			}
+			if(!ok)
+				break;
+
+			float max = pow(2, bits) - 1;
+			for(int y = 0; y < _yRes; y++){
+				for(int x = 0; x < _xRes; x++){
+					int index = y*_xRes+x;
+					if(sample == 0){
+						getPixel(x, y)->setR(data[index]/max);
+					}else if(sample == 1){
+						getPixel(x, y)->setG(data[index]/max);
+					}else if(sample == 2){
+						getPixel(x, y)->setB(data[index]/max);
+					}else if(sample == 3){
+						getPixel(x, y)->setA(data[index]/max);
+					}
+				}
+			}
+		}
+		delete[] data;
+
+		if (ok && TinyTIFFReader_wasError(tif)) {
+			ERROR("Encountered an error:");
+			ERROR(TinyTIFFReader_getLastError(tif));
+			ok = false;
+		}
+		TinyTIFFReader_close(tif);
+
+		if(!ok){
+			release();
+			_xRes = _yRes = _stride = 0;
+			return false;
+		}
+
+		if(verbose)
+			PRINT("file " << filename << " read successfully")
+		return true;
+	}
+
+	ImageBuffer(int xRes, int yRes, MemoryCategory category = MEM_FRAMEBUFFERS): _category(category){
+		allocate(xRes, yRes);
 	}
 
 	~ImageBuffer(){
-		delete[] _pixels;
+		release();
 	}
 
 	void clear(){
-		for(int i = 0; i < _xRes*_yRes; i++){
-			_pixels[i].clear();
-		}
+		view().clear();
 	}
 
 	void getDimensions(int& x, int& y){
@@ -112,13 +327,25 @@ public:
 		y = _yRes;
 	}
 
+	int getStride(){return _stride;}
+	size_t getBytes(){return (size_t)_stride*_yRes*sizeof(Pixel);}
+
+	// The whole buffer, placed at the origin of a frame of the same size
+	ImageView view(){
+		return ImageView(_pixels, 0, 0, _xRes, _yRes, _stride, _xRes, _yRes);
+	}
+
+	ImageView view(int x, int y, int width, int height){
+		return view().sub(x, y, width, height);
+	}
+
 	Pixel * getPixel(int x, int y){
 		if(x < 0 || x >= _xRes || y < 0 || y >= _yRes){
 			ERROR("ERROR - IMAGE_BUFFER - Can not get pixel (" << x << ", " << y << ") in ImageBuffer of size " << _xRes << "x" << _yRes);
 			return nullptr;
 		}
 
-		return &_pixels[y*_xRes + x];
+		return &_pixels[y*_stride + x];
 	}
 
 	void setPixel(int x, int y, Pixel * pix){
@@ -127,27 +354,69 @@ public:
 			return;
 		}
 
-		_pixels[y*_xRes + x] = *pix;
+		_pixels[y*_stride + x] = *pix;
 	}
 
-	void writeTIFF(const std::string& filename){
-		TinyTIFFWriterFile * tiffw = TinyTIFFWriter_open(filename.c_str(), 8, TinyTIFFWriter_UInt, 3, _xRes, _yRes, TinyTIFFWriter_RGB);
-		int totalCells = _xRes*_yRes;
-		uint8_t * pixels = new uint8_t[3*totalCells];
-		for(int i = 0; i < totalCells; i++){
-			pixels[i*3 + 0] = clamp(0, 255, _pixels[i][0]*255);
-			pixels[i*3 + 1] = clamp(0, 255, _pixels[i][1]*255);
-			pixels[i*3 + 2] = clamp(0, 255, _pixels[i][2]*255);
-		}
+	size_t getQuantizedBytes(const OutputFormat& format){return (size_t)3*_xRes*_yRes*format.bytesPerSample();}
 
-		TinyTIFFWriter_writeImage(tiffw, pixels);
-		TinyTIFFWriter_close(tiffw);
-		delete[] pixels;
+	// Packed RGB in format, getQuantizedBytes() of it
+	void quantize(const OutputFormat& format, void * out){
+		quantizeRows(_pixels, _stride, _xRes, _yRes, 0, format, out);
+	}
 
-		PRINT("Wrote file " << filename << " successfully");
+	void writeTIFF(const std::string& filename, const OutputFormat& format = OutputFormat()){
+		std::vector<uint8_t, TrackedAllocator<uint8_t, MEM_FRAMEBUFFERS>> pixels(getQuantizedBytes(format));
+		quantize(format, pixels.data());
+		writeQuantizedFrame(filename, pixels.data(), _xRes, _yRes, format);
 	}
 };
 
 
 
+// Scratch buffer handed out as a transparent view, over and over. It remembers
+// which tiles the last user wrote, so getting it ready again only clears those
+// instead of the whole buffer.
+class ScratchBuffer{
+	ImageBuffer _buffer;
+	ImageView _view; // Where it was last handed out
+	TileMask _dirty; // Tiles of _view that may not be transparent
+	bool _all_dirty;
+
+public:
+	ScratchBuffer(): _all_dirty(false){}
+
+	// Transparent view over [x0, x1) x [y0, y1) of the frame. Until setWritten()
+	// says otherwise all of it counts as written.
+	ImageView acquire(int x0, int y0, int x1, int y1, int frameWidth, int frameHeight){
+		int width, height;
+		_buffer.getDimensions(width, height);
+		if(width != x1 - x0 || height != y1 - y0){
+			_buffer = ImageBuffer(x1 - x0, y1 - y0);
+			_all_dirty = true;
+		}
+
+		if(_all_dirty){
+			_buffer.view().fill(Pixel(0, 0, 0, 0));
+		}else{
+			// Same memory whatever the placement, so clear through the old one
+			for(int ty = _dirty.getTileY0(); ty < _dirty.getTileY0() + _dirty.getTilesY(); ty++){
+				for(int tx = _dirty.getTileX0(); tx < _dirty.getTileX0() + _dirty.getTilesX(); tx++){
+					if(_dirty.test(tx, ty))
+						_view.sub(tx*TILE_SIZE, ty*TILE_SIZE, TILE_SIZE, TILE_SIZE).fill(Pixel(0, 0, 0, 0));
+				}
+			}
+		}
+
+		_view = _buffer.view().placed(x0, y0, frameWidth, frameHeight);
+		_all_dirty = true;
+		return _view;
+	}
+
+	// Tiles of the view last acquired that were written since
+	void setWritten(const TileMask& tiles){
+		_dirty = tiles;
+		_all_dirty = false;
+	}
+};
+
 #endif // IMAGE_BUFFER_H
\ No newline at end of file
@@ -3,9 +3,172 @@
 
 #include <EIGEN_SETTINGS.h>
 #include <stdio.h>
+#include <algorithm>
+#include <chrono>
 #include "funmath.h"
+#include "simd.h"
+#include "memory.h"
 
 #define BEZIER_LOOPS 16
+#define EASING_LUT_SIZE 64
+#define EASING_NEWTON_ITERATIONS 8
+#define EASING_EPSILON 1e-6f
+#define ANIMATOR_CHANGE_STEPS 4
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////EASING ENGINE///////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Easing curve from (0, 0) to (1, 1) with x(t) and y(t) kept as power basis
+// coefficients, a*t^3 + b*t^2 + c*t, so sampling is two Horner evaluations.
+// yFromX() solves x(t) = x with Newton-Raphson, falling back to bisection
+// when the slope flattens out. The optional lookup table holds t at evenly
+// spaced x and only seeds Newton, so it speeds things up without costing accuracy.
+class Easing{
+	float _ax, _bx, _cx;
+	float _ay, _by, _cy;
+	std::vector<float, TrackedAllocator<float, MEM_ANIMATION>> _lut;
+
+	float solveT(float x) const {
+		float t = initialGuess(x);
+		for(int i = 0; i < EASING_NEWTON_ITERATIONS; i++){
+			float error = sampleX(t) - x;
+			if(fabs(error) < EASING_EPSILON)
+				return t;
+			float slope = sampleDX(t);
+			if(fabs(slope) < EASING_EPSILON)
+				break;
+			t -= error/slope;
+			if(t < 0 || t > 1)
+				break;
+		}
+
+		// x(t) is monotonic for control points with x in [0, 1]
+		float lo = 0, hi = 1;
+		t = x;
+		for(int i = 0; i < 32 && hi - lo > EASING_EPSILON*EASING_EPSILON; i++){
+			if(sampleX(t) < x)
+				lo = t;
+			else
+				hi = t;
+			t = (lo + hi)/2;
+		}
+		return t;
+	}
+
+	float initialGuess(float x) const {
+		if(_lut.size() == 0)
+			return x;
+
+		float index = x*EASING_LUT_SIZE;
+		int i = std::min((int)index, EASING_LUT_SIZE - 1);
+		return _lut[i] + (index - i)*(_lut[i+1] - _lut[i]);
+	}
+
+public:
+	Easing(): _ax(0), _bx(0), _cx(1), _ay(0), _by(0), _cy(1){}
+
+	// Cubic from (0, 0) through control_1 and control_2 to (1, 1)
+	static Easing cubic(const VEC2& control_1, const VEC2& control_2){
+		Easing e;
+		e._cx = 3*control_1[0];
+		e._bx = 3*(control_2[0] - control_1[0]) - e._cx;
+		e._ax = 1 - e._cx - e._bx;
+		e._cy = 3*control_1[1];
+		e._by = 3*(control_2[1] - control_1[1]) - e._cy;
+		e._ay = 1 - e._cy - e._by;
+		return e;
+	}
+
+	// Quadratic from (0, 0) through control_1 to (1, 1)
+	static Easing quadratic(const VEC2& control_1){
+		Easing e;
+		e._ax = 0;
+		e._cx = 2*control_1[0];
+		e._bx = 1 - e._cx;
+		e._ay = 0;
+		e._cy = 2*control_1[1];
+		e._by = 1 - e._cy;
+		return e;
+	}
+
+	float sampleX(float t) const {return ((_ax*t + _bx)*t + _cx)*t;}
+	float sampleY(float t) const {return ((_ay*t + _by)*t + _cy)*t;}
+	float sampleDX(float t) const {return (3*_ax*t + 2*_bx)*t + _cx;}
+
+	void buildLUT(){
+		_lut.clear();
+		for(int i = 0; i <= EASING_LUT_SIZE; i++){
+			_lut.push_back(solveT((float)i/EASING_LUT_SIZE));
+		}
+		_lut.push_back(1);
+	}
+
+	bool hasLUT() const {return _lut.size() > 0;}
+
+	float yFromX(float x) const {
+		if(x <= 0)
+			return 0;
+		else if(x >= 1)
+			return 1;
+
+		return sampleY(solveT(x));
+	}
+
+	// y for n values of x at once, 8 lanes at a time. Lanes whose Newton
+	// iterations haven't converged are redone with the scalar solver.
+	void yFromX(const float * x, float * y, int n) const {
+		const float8 zero(0.0f), one(1.0f), epsilon(EASING_EPSILON), lutScale((float)EASING_LUT_SIZE);
+		const float8 ax(_ax), bx(_bx), cx(_cx), ay(_ay), by(_by), cy(_cy);
+		const float8 ax3(3*_ax), bx2(2*_bx);
+		float tail[8];
+
+		for(int i = 0; i < n; i += 8){
+			int lanes = std::min(8, n - i);
+			float8 xs;
+			if(lanes == 8){
+				xs = float8::load(x + i);
+			}else{
+				for(int l = 0; l < 8; l++) tail[l] = x[i + std::min(l, lanes - 1)];
+				xs = float8::load(tail);
+			}
+			float8 xc = min(max(xs, zero), one);
+
+			float8 t = xc;
+			if(_lut.size() > 0){
+				float8 index = min(xc*lutScale, float8(EASING_LUT_SIZE - 0.5f));
+				float8 base = floor(index);
+				float8 lo = gather(&_lut[0], base);
+				float8 hi = gather(&_lut[1], base);
+				t = lo + (index - base)*(hi - lo);
+			}
+
+			for(int k = 0; k < 2; k++){
+				float8 error = ((ax*t + bx)*t + cx)*t - xc;
+				float8 slope = (ax3*t + bx2)*t + cx;
+				float8 step = select(abs(slope) > epsilon, error/slope, zero);
+				t = min(max(t - step, zero), one);
+			}
+
+			float8 error = ((ax*t + bx)*t + cx)*t - xc;
+			int unconverged = movemask(abs(error) >= epsilon);
+			float8 result = ((ay*t + by)*t + cy)*t;
+			result = select(xs <= zero, zero, select(xs >= one, one, result));
+
+			if(lanes == 8 && !unconverged){
+				result.store(y + i);
+				continue;
+			}
+
+			result.store(tail);
+			for(int l = 0; l < lanes; l++){
+				if(unconverged & (1 << l))
+					tail[l] = yFromX(x[i + l]);
+				y[i + l] = tail[l];
+			}
+		}
+	}
+};
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////BEZIER STUFF////////////////////////////////////////////////////
@@ -15,9 +178,11 @@ class Bezier2{
 	VEC2 P0 = VEC2(0.0f, 0.0f);
 	VEC2 P1;
 	VEC2 P2 = VEC2(1.0f, 1.0f);
+	Easing easing;
 public:
 	Bezier2(){
 		P1 = VEC2(0,0);
+		easing = Easing::quadratic(P1);
 	}
 
 	Bezier2(VEC2 control_1){
@@ -30,6 +195,8 @@ public:
 		}
 
 		P1 = control_1;
+		easing = Easing::quadratic(P1);
+		easing.buildLUT();
 	}
 
 	float tFromX(float x){
@@ -51,10 +218,21 @@ public:
 			return VEC2(0, 0);
 		}
 
-		return pow(t, 2)*(P0 - 2*P1 + P2) + t*(2*P1) + P0;
+		return t*t*(P0 - 2*P1 + P2) + t*(2*P1) + P0;
 	}
-	
+
+	const Easing& getEasing(){return easing;}
+
 	float yFromX(float x){
+		return easing.yFromX(x);
+	}
+
+	void yFromX(const float * x, float * y, int n){
+		easing.yFromX(x, y, n);
+	}
+
+	// The original 16 step bisection, kept as a reference for benchmarkEasing()
+	float yFromXBisection(float x){
 		if(x == 0)
 			return 0;
 		else if(x == 1)
@@ -91,10 +269,12 @@ class Bezier3{
 	VEC2 P1;
 	VEC2 P2;
 	VEC2 P3 = VEC2(1, 1);
+	Easing easing;
 public:
 	Bezier3(){
 		P1 = VEC2(0, 0);
 		P2 = VEC2(1, 1);
+		easing = Easing::cubic(P1, P2);
 	}
 
 	Bezier3(VEC2 control_1, VEC2 control_2){
@@ -112,13 +292,27 @@ public:
 
 		P1 = control_1;
 		P2 = control_2;
+		easing = Easing::cubic(P1, P2);
+		easing.buildLUT();
 	}
 
 	VEC2 bezier(float t){
-		return 3*pow(1-t, 2)*t*P1 + 3*(1-t)*pow(t, 2)*P2+pow(t, 3)*P3;
+		float s = 1-t;
+		return 3*s*s*t*P1 + 3*s*t*t*P2 + t*t*t*P3;
 	}
 
+	const Easing& getEasing(){return easing;}
+
 	float yFromX(float x){
+		return easing.yFromX(x);
+	}
+
+	void yFromX(const float * x, float * y, int n){
+		easing.yFromX(x, y, n);
+	}
+
+	// The original 16 step bisection, kept as a reference for benchmarkEasing()
+	float yFromXBisection(float x){
 		if(x == 0)
 			return 0;
 		else if(x == 1)
@@ -151,6 +345,48 @@ public:
 
 };
 
+// Times the easing solvers against the original bisection and reports the
+// largest difference from it. Run with ./effect bench-easing
+void benchmarkEasing(){
+	const int n = 1 << 20;
+	std::vector<float> x(n), y(n);
+	for(int i = 0; i < n; i++){
+		x[i] = (i*0.618034f) - (int)(i*0.618034f);
+	}
+
+	Bezier3 curves[] = {
+		Bezier3(VEC2(0.42, 0), VEC2(0.58, 1)),
+		Bezier3(VEC2(0.33, 0), VEC2(0.67, 1)),
+		Bezier3(VEC2(0.9, 0.1), VEC2(0.1, 0.9)),
+		Bezier3(VEC2(0, 0), VEC2(1, 1))
+	};
+
+	typedef std::chrono::steady_clock Clock;
+	std::vector<float> reference(n);
+	for(Bezier3& curve : curves){
+		Clock::time_point start = Clock::now();
+		for(int i = 0; i < n; i++) reference[i] = curve.yFromXBisection(x[i]);
+		double bisection = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		start = Clock::now();
+		for(int i = 0; i < n; i++) y[i] = curve.yFromX(x[i]);
+		double scalar = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		float scalarDiff = 0;
+		for(int i = 0; i < n; i++) scalarDiff = std::max(scalarDiff, (float)fabs(y[i] - reference[i]));
+
+		start = Clock::now();
+		curve.yFromX(&x[0], &y[0], n);
+		double batch = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		float batchDiff = 0;
+		for(int i = 0; i < n; i++) batchDiff = std::max(batchDiff, (float)fabs(y[i] - reference[i]));
+
+		PRINT(n << " samples: bisection " << bisection << " ms, newton " << scalar << " ms, batch " << batch
+			<< " ms (max diff from bisection " << scalarDiff << " / " << batchDiff << ")");
+	}
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////INTERPOLATOR STUFF/////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -158,7 +394,17 @@ public:
 
 class Interpolator{
 public:
+	TRACKED_NEW(MEM_ANIMATION)
+
+	virtual ~Interpolator(){}
 	virtual float interpolate(float t) = 0;
+
+	// Batch form, for evaluating many samples of one segment at once
+	virtual void interpolate(const float * t, float * out, int n){
+		for(int i = 0; i < n; i++){
+			out[i] = interpolate(t[i]);
+		}
+	}
 };
 
 class Interpolator_Linear : public Interpolator{
@@ -166,6 +412,10 @@ public:
 	float interpolate(float t){
 		return t;
 	}
+
+	void interpolate(const float * t, float * out, int n){
+		memcpy(out, t, n*sizeof(float));
+	}
 };
 
 class Interpolator_Bezier2 : public Interpolator{
@@ -179,6 +429,10 @@ public:
 		float result = bezier2.yFromX(t);
 		return result;
 	}
+
+	void interpolate(const float * t, float * out, int n){
+		bezier2.yFromX(t, out, n);
+	}
 };
 
 class Interpolator_Bezier3 : public Interpolator{
@@ -192,6 +446,10 @@ public:
 		float result = bezier3.yFromX(t);
 		return result;
 	}
+
+	void interpolate(const float * t, float * out, int n){
+		bezier3.yFromX(t, out, n);
+	}
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -203,6 +461,8 @@ struct Float_Keyframe{
 	float _value;
 	Interpolator * _interpolator;
 
+	TRACKED_NEW(MEM_ANIMATION)
+
 	Float_Keyframe(float frame, float value, Interpolator * interpolator): _frame(frame), _value(value){
 		_interpolator = interpolator;
 	}
@@ -221,6 +481,14 @@ struct Float_Keyframe{
 
 class Float_Animator{
 	std::vector<Float_Keyframe *> _keyframes;
+
+	// Keeps _keyframes in frame order; one added on the same frame as another goes after it
+	void insert(Float_Keyframe * keyframe){
+		auto later = std::upper_bound(_keyframes.begin(), _keyframes.end(), keyframe, [](Float_Keyframe * a, Float_Keyframe * b){
+			return a->_frame < b->_frame;
+		});
+		_keyframes.insert(later, keyframe);
+	}
 public:
 	Float_Animator(){}
 	~Float_Animator(){
@@ -232,34 +500,29 @@ public:
 	// Bezier3 -------------------------------------------------------
 	void addBezier3Keyframe(float frame, float value, VEC2 control_1, VEC2 control_2){
 		Interpolator * interp = new Interpolator_Bezier3(control_1, control_2);
-		_keyframes.push_back(new Float_Keyframe(frame, value, interp));
-		std::sort(_keyframes.begin(), _keyframes.end());
+		insert(new Float_Keyframe(frame, value, interp));
 	}
 
 	void addBezier3Keyframe(float frame, float value, float influence_1, float influence_2){
 		Interpolator * interp = new Interpolator_Bezier3(VEC2(influence_1, 0), VEC2(1-influence_2, 1));
-		_keyframes.push_back(new Float_Keyframe(frame, value, interp));
-		std::sort(_keyframes.begin(), _keyframes.end());
+		insert(new Float_Keyframe(frame, value, interp));
 	}
 
 	// Bezier2 -------------------------------------------------------
 	void addBezier2Keyframe(float frame, float value, VEC2 control_1){
 		Interpolator * interp = new Interpolator_Bezier2(control_1);
-		_keyframes.push_back(new Float_Keyframe(frame, value, interp));
-		std::sort(_keyframes.begin(), _keyframes.end());
+		insert(new Float_Keyframe(frame, value, interp));
 	}
 
 	void addBezier2Keyframe(float frame, float value, float influence_1){
 		Interpolator * interp = new Interpolator_Bezier2(VEC2(influence_1, 0));
-		_keyframes.push_back(new Float_Keyframe(frame, value, interp));
-		std::sort(_keyframes.begin(), _keyframes.end());
+		insert(new Float_Keyframe(frame, value, interp));
 	}
 
 	// Linear -------------------------------------------------------
 	void addLinearKeyframe(float frame, float value){
 		Interpolator * interp = new Interpolator_Linear();
-		_keyframes.push_back(new Float_Keyframe(frame, value, interp));
-		std::sort(_keyframes.begin(), _keyframes.end());
+		insert(new Float_Keyframe(frame, value, interp));
 	}
 
 	float interpolate(float frame){
@@ -291,6 +554,159 @@ public:
 
 		return LERP(previous->_value, next->_value, percent);
 	}
+
+	// How far the value travels over frames [t0, t1], 0 if it holds still.
+	// Each stretch between keyframes is followed at a few points, so an ease
+	// that overshoots and comes back still counts.
+	float getChange(float t0, float t1){
+		std::vector<float> times(1, t0);
+		float first = t1, last = t0;
+		for(int i = 0; i < _keyframes.size(); i++){
+			float frame = _keyframes[i]->_frame;
+			first = std::min(first, frame);
+			last = std::max(last, frame);
+			if(frame > t0 && frame < t1)
+				times.push_back(frame);
+		}
+		// Constant before the first keyframe and after the last
+		if(_keyframes.size() < 2 || t1 <= first || t0 >= last)
+			return 0;
+		times.push_back(t1);
+		std::sort(times.begin(), times.end());
+
+		float change = 0, previous = interpolate(t0);
+		for(int i = 1; i < times.size(); i++){
+			for(int s = 1; s <= ANIMATOR_CHANGE_STEPS; s++){
+				float value = interpolate(LERP(times[i-1], times[i], (float)s/ANIMATOR_CHANGE_STEPS));
+				change += fabs(value - previous);
+				previous = value;
+			}
+		}
+		return change;
+	}
 };
 
+// Animates every component of a VEC2, VEC3 or VEC4 together, e.g. a point or
+// a colour. Keyframes are kept as parallel arrays (frames, then all the
+// values component after component, then the easings), so finding where a
+// frame falls is one binary search over packed floats and each call eases
+// once for the whole vector, rather than once per component as separate
+// Float_Animators would.
+template <class VEC>
+class Vector_Animator{
+	enum{N = VEC::RowsAtCompileTime};
+
+	std::vector<float, TrackedAllocator<float, MEM_ANIMATION>> _frames;
+	std::vector<float, TrackedAllocator<float, MEM_ANIMATION>> _values; // N per keyframe
+	std::vector<Easing, TrackedAllocator<Easing, MEM_ANIMATION>> _easings; // Out of each keyframe
+
+	// One added on the same frame as another goes after it
+	void insert(float frame, const VEC& value, const Easing& easing){
+		int index = std::upper_bound(_frames.begin(), _frames.end(), frame) - _frames.begin();
+		float components[N];
+		for(int c = 0; c < N; c++){
+			components[c] = value[c];
+		}
+		_frames.insert(_frames.begin() + index, frame);
+		_values.insert(_values.begin() + index*N, components, components + N);
+		_easings.insert(_easings.begin() + index, easing);
+	}
+
+public:
+	TRACKED_NEW(MEM_ANIMATION)
+
+	Vector_Animator(){}
+
+	// Bezier3 -------------------------------------------------------
+	void addBezier3Keyframe(float frame, const VEC& value, VEC2 control_1, VEC2 control_2){
+		insert(frame, value, Bezier3(control_1, control_2).getEasing());
+	}
+
+	void addBezier3Keyframe(float frame, const VEC& value, float influence_1, float influence_2){
+		insert(frame, value, Bezier3(VEC2(influence_1, 0), VEC2(1-influence_2, 1)).getEasing());
+	}
+
+	// Bezier2 -------------------------------------------------------
+	void addBezier2Keyframe(float frame, const VEC& value, VEC2 control_1){
+		insert(frame, value, Bezier2(control_1).getEasing());
+	}
+
+	void addBezier2Keyframe(float frame, const VEC& value, float influence_1){
+		insert(frame, value, Bezier2(VEC2(influence_1, 0)).getEasing());
+	}
+
+	// Linear -------------------------------------------------------
+	void addLinearKeyframe(float frame, const VEC& value){
+		insert(frame, value, Easing());
+	}
+
+	int getKeyframeCount(){return _frames.size();}
+
+	// Writes the N components at frame to out
+	void interpolate(float frame, float * out){
+		if(_frames.size() == 0){
+			ERROR("ERROR - KEYFRAME - Can't interpolate with no keyframes");
+			std::fill(out, out + N, -1.0f);
+			return;
+		}
+
+		int next = std::upper_bound(_frames.begin(), _frames.end(), frame) - _frames.begin();
+		int previous = std::max(next - 1, 0);
+		next = std::min(next, (int)_frames.size() - 1);
+
+		float percent = 1;
+		if(next != previous)
+			percent = _easings[previous].yFromX((frame - _frames[previous]) / (_frames[next] - _frames[previous]));
+
+		const float * a = &_values[previous*N];
+		const float * b = &_values[next*N];
+		for(int c = 0; c < N; c++){
+			out[c] = LERP(a[c], b[c], percent);
+		}
+	}
+
+	VEC interpolate(float frame){
+		float components[N];
+		interpolate(frame, components);
+		VEC value;
+		for(int c = 0; c < N; c++){
+			value[c] = components[c];
+		}
+		return value;
+	}
+
+	// Length of the path the vector takes over frames [t0, t1], followed the
+	// same way as Float_Animator::getChange()
+	float getChange(float t0, float t1){
+		if(_frames.size() < 2 || t1 <= _frames.front() || t0 >= _frames.back())
+			return 0;
+
+		std::vector<float> times(1, t0);
+		for(int i = 0; i < _frames.size(); i++){
+			if(_frames[i] > t0 && _frames[i] < t1)
+				times.push_back(_frames[i]);
+		}
+		times.push_back(t1);
+
+		float change = 0, previous[N], value[N];
+		interpolate(t0, previous);
+		for(int i = 1; i < times.size(); i++){
+			for(int s = 1; s <= ANIMATOR_CHANGE_STEPS; s++){
+				interpolate(LERP(times[i-1], times[i], (float)s/ANIMATOR_CHANGE_STEPS), value);
+				float length = 0;
+				for(int c = 0; c < N; c++){
+					length += (value[c] - previous[c])*(value[c] - previous[c]);
+					previous[c] = value[c];
+				}
+				change += sqrt(length);
+			}
+		}
+		return change;
+	}
+};
+
+typedef Vector_Animator<VEC2> VEC2_Animator;
+typedef Vector_Animator<VEC3> VEC3_Animator;
+typedef Vector_Animator<VEC4> VEC4_Animator;
+
 #endif // KEYFRAME_H
\ No newline at end of file
@@ -3,33 +3,232 @@
 
 #include <EIGEN_SETTINGS.h>
 #include "image_buffer.h"
+#include "keyframe.h"
+#include "effects.h"
+#include "mask.h"
+#include "tiles.h"
 #include <limits>
 
+// Times along the shutter the transform is followed at, for getMotion()
+#define MOTION_STEPS 8
+
 enum BlendMode{
-	BLEND_NORMAL
+	BLEND_NORMAL, // Premultiplied "over"
+	BLEND_ADD,
+	BLEND_UNDER   // Not for layers: "over" the other way round, for compositing front to back
+};
+
+// How a track matte's pixels turn into the matted layer's coverage
+enum MatteMode{
+	MATTE_ALPHA,
+	MATTE_ALPHA_INVERTED,
+	MATTE_LUMA, // Rec.709 luma of the premultiplied colour, so transparent is black
+	MATTE_LUMA_INVERTED
 };
 
 
 class Layer{
 	float _in_point, _out_point;
+	BlendMode _blend_mode;
+
+	// Transform animators, nullptr means the default value. Not owned, same as
+	// the animators handed to Lines.
+	Float_Animator * _position_x = nullptr;
+	Float_Animator * _position_y = nullptr;
+	Float_Animator * _anchor_x = nullptr;
+	Float_Animator * _anchor_y = nullptr;
+	Float_Animator * _scale_x = nullptr;
+	Float_Animator * _scale_y = nullptr;
+	Float_Animator * _rotation = nullptr;
+	Float_Animator * _opacity = nullptr;
+
+	// Applied in order after the layer renders. Owned by the layer.
+	std::vector<Effect *> _effects;
+
+	// Owned by the layer. The matte is rendered in its place in the comp but
+	// only used to cut this layer, it never shows itself.
+	Layer * _matte = nullptr;
+	MatteMode _matte_mode = MATTE_ALPHA;
+	std::vector<Mask> _masks;
+
+	static float sample(Float_Animator * animator, float frame_num, float default_value){
+		return (animator ? animator->interpolate(frame_num) : default_value);
+	}
+
+	static float change(Float_Animator * animator, float t0, float t1){
+		return (animator ? animator->getChange(t0, t1) : 0);
+	}
+
 public:
 	Layer(){
 		_in_point = std::numeric_limits<float>::min();
 		_out_point = std::numeric_limits<float>::max();
+		_blend_mode = BLEND_NORMAL;
 	}
 
 	Layer(float in, float out){
 		_in_point = in;
 		_out_point = out;
+		_blend_mode = BLEND_NORMAL;
+	}
+
+	virtual ~Layer(){
+		for(int i = 0; i < _effects.size(); i++){
+			delete _effects[i];
+		}
+		for(int i = 0; i < _masks.size(); i++){
+			delete _masks[i].shape;
+		}
+		delete _matte;
 	}
 
 	float getInPoint(){return _in_point;}
 	void setInPoint(float in_point){_in_point = in_point;}
 	float getOutPoint(){return _out_point;}
 	void setOutPoint(float out_point){_out_point = out_point;}
+	BlendMode getBlendMode(){return _blend_mode;}
+	void setBlendMode(BlendMode blend_mode){_blend_mode = blend_mode;}
+
+	// Frame space position the anchor point ends up at, in pixels
+	void setPosition(Float_Animator * x, Float_Animator * y){_position_x = x; _position_y = y;}
+	// Point in layer space that scaling and rotation happen around, in pixels
+	void setAnchor(Float_Animator * x, Float_Animator * y){_anchor_x = x; _anchor_y = y;}
+	// 1 is 100%
+	void setScale(Float_Animator * x, Float_Animator * y){_scale_x = x; _scale_y = y;}
+	// Degrees, clockwise on screen (frame space y points down)
+	void setRotation(Float_Animator * rotation){_rotation = rotation;}
+	// 0 to 1
+	void setOpacity(Float_Animator * opacity){_opacity = opacity;}
+
+	bool hasTransform(){
+		return _position_x || _position_y || _anchor_x || _anchor_y || _scale_x || _scale_y || _rotation;
+	}
+
+	// Layer to frame transform as a 2x3 matrix: frame = M * (layer_x, layer_y, 1)
+	void getTransform(float frame_num, float m[6]){
+		float px = sample(_position_x, frame_num, 0);
+		float py = sample(_position_y, frame_num, 0);
+		float ax = sample(_anchor_x, frame_num, 0);
+		float ay = sample(_anchor_y, frame_num, 0);
+		float sx = sample(_scale_x, frame_num, 1);
+		float sy = sample(_scale_y, frame_num, 1);
+		float angle = sample(_rotation, frame_num, 0)*M_PI/180;
+		float c = cos(angle), s = sin(angle);
+
+		// frame = position + R*S*(layer - anchor)
+		m[0] = c*sx; m[1] = -s*sy;
+		m[3] = s*sx; m[4] = c*sy;
+		m[2] = px - (m[0]*ax + m[1]*ay);
+		m[5] = py - (m[3]*ax + m[4]*ay);
+	}
+
+	float getOpacity(float frame_num){
+		return clamp(0, 1, sample(_opacity, frame_num, 1));
+	}
+
+	// How far, in frame pixels, anything the layer draws moves between frames
+	// t0 and t1, for a layer the size of a width x height frame. 0 means it
+	// looks the same all the way through (opacity aside), so motion blur can
+	// draw it once.
+	float getMotion(float t0, float t1, int width, int height){
+		float motion = 0;
+		bool moves = change(_position_x, t0, t1) > 0 || change(_position_y, t0, t1) > 0 || change(_anchor_x, t0, t1) > 0 ||
+			change(_anchor_y, t0, t1) > 0 || change(_scale_x, t0, t1) > 0 || change(_scale_y, t0, t1) > 0 || change(_rotation, t0, t1) > 0;
+		if(moves){
+			// Length of the path the furthest travelling corner takes
+			float corners[4][2] = {{0, 0}, {(float)width, 0}, {0, (float)height}, {(float)width, (float)height}};
+			float previous[4][2], lengths[4] = {0, 0, 0, 0};
+			for(int step = 0; step <= MOTION_STEPS; step++){
+				float m[6];
+				getTransform(LERP(t0, t1, (float)step/MOTION_STEPS), m);
+				for(int c = 0; c < 4; c++){
+					float x = m[0]*corners[c][0] + m[1]*corners[c][1] + m[2];
+					float y = m[3]*corners[c][0] + m[4]*corners[c][1] + m[5];
+					if(step > 0)
+						lengths[c] += hypot(x - previous[c][0], y - previous[c][1]);
+					previous[c][0] = x;
+					previous[c][1] = y;
+				}
+			}
+			motion = *std::max_element(lengths, lengths + 4);
+		}
+
+		float content = getContentMotion(t0, t1);
+		if(content > 0){
+			float m[6];
+			getTransform(t0, m);
+			motion += content*std::max(hypot(m[0], m[3]), hypot(m[1], m[4]));
+		}
+
+		if(_matte)
+			motion = std::max(motion, _matte->getMotion(t0, t1, width, height));
+		return motion;
+	}
+
+	// How far what the layer draws moves in its own pixel space between frames
+	// t0 and t1, before the transform. Layers whose content animates override it.
+	virtual float getContentMotion(float t0, float t1){return 0;}
+
+	// Takes ownership of effect
+	void addEffect(Effect * effect){_effects.push_back(effect);}
+	bool hasEffects(){return !_effects.empty();}
+
+	// How far outside a region the layer must be rendered for its effects to be
+	// right inside it. Effects run one after another, so their reach adds up.
+	int getEffectMargin(float frame_num){
+		int margin = 0;
+		for(int i = 0; i < _effects.size(); i++){
+			margin += _effects[i]->getMargin(frame_num);
+		}
+		return margin;
+	}
+
+	void applyEffects(const ImageView& buffer, float frame_num){
+		for(int i = 0; i < _effects.size(); i++){
+			_effects[i]->apply(buffer, frame_num);
+		}
+	}
+
+	// Takes ownership of matte
+	void setTrackMatte(Layer * matte, MatteMode mode = MATTE_ALPHA){
+		delete _matte;
+		_matte = matte;
+		_matte_mode = mode;
+	}
+	Layer * getTrackMatte(){return _matte;}
+	MatteMode getMatteMode(){return _matte_mode;}
+
+	// Takes ownership of shape, which is in the layer's own pixel space
+	void addMask(Geometry * shape, MaskMode mode = MASK_ADD, bool inverted = false){
+		Mask mask;
+		mask.shape = shape;
+		mask.mode = mode;
+		mask.inverted = inverted;
+		_masks.push_back(mask);
+	}
+	bool hasMasks(){return !_masks.empty();}
+
+	// Tiles of [x0, x1) x [y0, y1) the masks can leave visible
+	TileMask getMaskTiles(int x0, int y0, int x1, int y1){
+		if(_masks.empty())
+			return TileMask(x0, y0, x1, y1, true);
+		return maskTiles(_masks, x0, y0, x1, y1);
+	}
+
+	// Clears what the masks hide in the written tiles of buffer
+	void applyMasks(const ImageView& buffer, const TileMask& written){
+		::applyMasks(_masks, buffer, written);
+	}
+
+	// Whether render() marks what it writes in a tracking target (see
+	// ImageView::markWritten). Layers that don't are taken to write everywhere.
+	virtual bool tracksWrites(){return false;}
 
-	virtual void render(ImageBuffer * target, float frame_num) = 0;
+	// Draws the layer into target, whose coordinates are in frame space. With a
+	// coverage mask only pixels in its set tiles are going to be used, so a
+	// layer may skip the rest; what ends up in them doesn't matter.
+	virtual void render(const ImageView& target, float frame_num, const TileMask * coverage = nullptr) = 0;
 };
 
 
-#endif // LAYER_H
\ No newline at end of file
+#endif // LAYER_H
@@ -11,8 +11,9 @@ struct Bresenham{
 };
 
 
+// Ends are animated as whole points, not owned
 struct AnimatedBresenham{
-	Float_Animator *x0, *y0, *x1, *y1;
+	VEC2_Animator *start, *end;
 };
 
 class Lines: public Layer{
@@ -22,15 +23,22 @@ public:
 	Lines(){}
 	~Lines(){}
 
-	void addAnimatedBresenham(Float_Animator * x0, Float_Animator * y0, Float_Animator * x1, Float_Animator * y1){
+	void addAnimatedBresenham(VEC2_Animator * start, VEC2_Animator * end){
 		AnimatedBresenham b;
-		b.x0 = x0;
-		b.y0 = y0;
-		b.x1 = x1;
-		b.y1 = y1;
+		b.start = start;
+		b.end = end;
 		animBresenhams.push_back(b);
 	}
 
+	float getContentMotion(float t0, float t1){
+		float motion = 0;
+		for(int i = 0; i < animBresenhams.size(); i++){
+			const AnimatedBresenham& b = animBresenhams[i];
+			motion = std::max(motion, std::max(b.start->getChange(t0, t1), b.end->getChange(t0, t1)));
+		}
+		return motion;
+	}
+
 	void addBresenham(int x0, int y0, int x1, int y1){
 		Bresenham b;
 		b.x0 = x0;
@@ -40,15 +48,16 @@ public:
 		bresenhams.push_back(b);
 	}
 
-	void paintPixel(ImageBuffer * target, int x, int y){
-		int xRes, yRes;
-		target->getDimensions(xRes, yRes);
-		if(!(x < 0 || x >= xRes || y < 0 || y >= yRes)){
-			target->getPixel(x, yRes - y - 1)->set(255, 0, 0);
+	void paintPixel(const ImageView& target, int x, int y){
+		// Lines are in y-up frame space
+		int flipped_y = target.getFrameHeight() - y - 1;
+		if(target.contains(x, flipped_y)){
+			target.getPixel(x, flipped_y)->set(255, 0, 0, 1);
+			target.markWritten(x, flipped_y, x + 1, flipped_y + 1);
 		}
 	}
 
-	void renderBresenhams(ImageBuffer * target, float frame_num){
+	void renderBresenhams(const ImageView& target, float frame_num){
 		for(int i = 0; i < bresenhams.size(); i++){
 			// We don't want to mess with the data every time render is called
 			int x0 = bresenhams[i].x0;
@@ -105,13 +114,16 @@ public:
 		}
 	}
 
-	void renderAnimBresenhams(ImageBuffer * target, float frame_num){
+	void renderAnimBresenhams(const ImageView& target, float frame_num){
 		for(int i = 0; i < animBresenhams.size(); i++){
 			// We don't want to mess with the data every time render is called
-			int x0 = animBresenhams[i].x0->interpolate(frame_num);
-			int x1 = animBresenhams[i].x1->interpolate(frame_num);
-			int y0 = animBresenhams[i].y0->interpolate(frame_num);
-			int y1 = animBresenhams[i].y1->interpolate(frame_num);
+			float start[2], end[2];
+			animBresenhams[i].start->interpolate(frame_num, start);
+			animBresenhams[i].end->interpolate(frame_num, end);
+			int x0 = start[0];
+			int x1 = end[0];
+			int y0 = start[1];
+			int y1 = end[1];
 
 			// Make sure slope <= 1
 			float slope = (float)(y1-y0)/(x1-x0);
@@ -162,7 +174,9 @@ public:
 		}
 	}
 
-	void render(ImageBuffer * target, float frame_num){
+	bool tracksWrites(){return true;}
+
+	void render(const ImageView& target, float frame_num, const TileMask * coverage = nullptr){
 		for(int i = 0; i < bresenhams.size(); i++){
 			renderBresenhams(target, frame_num);
 		}
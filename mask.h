@@ -0,0 +1,91 @@
+#ifndef MASK_H
+#define MASK_H
+
+#include <EIGEN_SETTINGS.h>
+#include <math.h>
+#include "geometry.h"
+#include "image_buffer.h"
+#include "tiles.h"
+#include "parallel.h"
+
+// Layer masks. A mask is a Geometry in the layer's own pixel space (before its
+// transform); a pixel is inside it where getColor() hits. Masks combine in the
+// order they were added, starting from nothing when the first one adds and
+// from everything otherwise.
+
+enum MaskMode{
+	MASK_ADD,
+	MASK_SUBTRACT,
+	MASK_INTERSECT
+};
+
+struct Mask{
+	Geometry * shape;
+	MaskMode mode;
+	bool inverted;
+};
+
+bool insideMasks(const std::vector<Mask>& masks, const VEC2& pos){
+	bool inside = (masks[0].mode != MASK_ADD);
+	VEC3 col;
+	for(int i = 0; i < masks.size(); i++){
+		bool hit = (masks[i].shape->getColor(pos, &col) != masks[i].inverted);
+		if(masks[i].mode == MASK_ADD)
+			inside = inside || hit;
+		else if(masks[i].mode == MASK_SUBTRACT)
+			inside = inside && !hit;
+		else
+			inside = inside && hit;
+	}
+	return inside;
+}
+
+// Tiles of [x0, x1) x [y0, y1) the masks might leave visible. Conservative: a
+// subtracted shape never clears a tile.
+TileMask maskTiles(const std::vector<Mask>& masks, int x0, int y0, int x1, int y1){
+	TileMask tiles(x0, y0, x1, y1, masks[0].mode != MASK_ADD);
+	for(int i = 0; i < masks.size(); i++){
+		VEC2 lo, hi;
+		bool bounded = !masks[i].inverted && masks[i].shape->getBounds(lo, hi);
+		// Pixels are sampled at integer coordinates
+		int bx0 = 0, by0 = 0, bx1 = 0, by1 = 0;
+		if(bounded){
+			bx0 = (int)ceil(lo[0]); by0 = (int)ceil(lo[1]);
+			bx1 = (int)floor(hi[0]) + 1; by1 = (int)floor(hi[1]) + 1;
+		}
+
+		if(masks[i].mode == MASK_ADD){
+			if(bounded)
+				tiles.setRect(bx0, by0, bx1, by1);
+			else
+				tiles.setRect(x0, y0, x1, y1);
+		}else if(masks[i].mode == MASK_INTERSECT && bounded){
+			TileMask shape(x0, y0, x1, y1);
+			shape.setRect(bx0, by0, bx1, by1);
+			tiles.intersect(shape);
+		}
+	}
+	return tiles;
+}
+
+// Clears every pixel of buffer outside the masks. Only the tiles set in
+// written are looked at, the rest are taken to be transparent already.
+void applyMasks(const std::vector<Mask>& masks, const ImageView& buffer, const TileMask& written){
+	if(masks.empty() || buffer.isEmpty())
+		return;
+
+	TileMask tiles = maskTiles(masks, buffer.getX0(), buffer.getY0(), buffer.getX1(), buffer.getY1());
+	parallelFor(buffer.getY0(), buffer.getY1(), 8, [&](int begin, int end){
+		for(int y = begin; y < end; y++){
+			Pixel * row = buffer.row(y) - buffer.getX0();
+			written.forEachRun(y, buffer.getX0(), buffer.getX1(), [&](int x0, int x1){
+				for(int x = x0; x < x1; x++){
+					if(!tiles.covers(x, y) || !insideMasks(masks, VEC2(x, y)))
+						row[x].set(0, 0, 0, 0);
+				}
+			});
+		}
+	});
+}
+
+#endif // MASK_H
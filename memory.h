@@ -0,0 +1,196 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <EIGEN_SETTINGS.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Accounting for the large allocations: pixel buffers, decoded textures and
+// frames, caches and animation data. Every tracked allocation is counted
+// against a category, with peaks kept per category and overall.
+//
+// With a budget set, an allocation that would go over it first asks the
+// registered evictors (caches that can drop things and re-create them later)
+// to give memory back. Allocations that still don't fit go ahead anyway, the
+// rest of a render can't do without them, and the report shows by how much
+// the budget was blown.
+
+enum MemoryCategory{
+	MEM_FRAMEBUFFERS, // Output, band and layer scratch buffers
+	MEM_TEXTURES,     // Images loaded from disk for Texture and Shapes
+	MEM_CACHES,       // Decoded footage, RAM preview frames and particle states
+	MEM_ANIMATION,    // Keyframes, interpolators and easing tables
+	MEM_CATEGORIES
+};
+
+static const char * MEMORY_CATEGORY_NAMES[MEM_CATEGORIES] = {"framebuffers", "textures", "caches", "animation"};
+
+// Holds memory it can do without, e.g. a cache of frames it can decode again
+class MemoryEvictor{
+public:
+	virtual ~MemoryEvictor(){}
+
+	// Frees about bytes (more or less) of what it can spare, returns how much it
+	// freed. Called from whichever thread is allocating, so it must not allocate
+	// tracked memory itself or wait on anything that might be.
+	virtual size_t releaseMemory(size_t bytes) = 0;
+};
+
+class MemoryTracker{
+	std::atomic<int64_t> _current[MEM_CATEGORIES], _peak[MEM_CATEGORIES];
+	std::atomic<int64_t> _total, _total_peak;
+	std::atomic<size_t> _budget; // 0 is no budget
+	std::atomic<bool> _warned;
+	std::mutex _evictors_mutex;
+	std::vector<MemoryEvictor *> _evictors;
+
+	static void raisePeak(std::atomic<int64_t>& peak, int64_t value){
+		int64_t seen = peak.load();
+		while(value > seen && !peak.compare_exchange_weak(seen, value)){}
+	}
+
+	static bool& insideEvictor(){
+		static thread_local bool inside = false;
+		return inside;
+	}
+
+public:
+	MemoryTracker(): _total(0), _total_peak(0), _budget(0), _warned(false){
+		for(int i = 0; i < MEM_CATEGORIES; i++){
+			_current[i] = 0;
+			_peak[i] = 0;
+		}
+	}
+
+	void setBudget(size_t bytes){_budget = bytes;}
+	size_t getBudget(){return _budget;}
+
+	size_t getUsed(){return _total;}
+	size_t getUsed(MemoryCategory category){return _current[category];}
+	size_t getPeak(){return _total_peak;}
+	size_t getPeak(MemoryCategory category){return _peak[category];}
+
+	// Room left under the budget
+	size_t getAvailable(){
+		size_t budget = _budget, used = _total;
+		if(budget == 0)
+			return SIZE_MAX;
+		return (used < budget ? budget - used : 0);
+	}
+
+	void addEvictor(MemoryEvictor * evictor){
+		std::lock_guard<std::mutex> lock(_evictors_mutex);
+		_evictors.push_back(evictor);
+	}
+
+	void removeEvictor(MemoryEvictor * evictor){
+		std::lock_guard<std::mutex> lock(_evictors_mutex);
+		_evictors.erase(std::remove(_evictors.begin(), _evictors.end(), evictor), _evictors.end());
+	}
+
+	// Makes room for bytes more under the budget, asking evictors if needed.
+	// False if there still isn't room.
+	bool reserve(size_t bytes){
+		if(getAvailable() >= bytes)
+			return true;
+		if(insideEvictor())
+			return false;
+
+		std::lock_guard<std::mutex> lock(_evictors_mutex);
+		insideEvictor() = true;
+		for(int i = 0; i < _evictors.size() && getAvailable() < bytes; i++){
+			_evictors[i]->releaseMemory(bytes - getAvailable());
+		}
+		insideEvictor() = false;
+		return getAvailable() >= bytes;
+	}
+
+	void allocated(size_t bytes, MemoryCategory category){
+		raisePeak(_peak[category], _current[category] += bytes);
+		raisePeak(_total_peak, _total += bytes);
+	}
+
+	void freed(size_t bytes, MemoryCategory category){
+		_current[category] -= bytes;
+		_total -= bytes;
+	}
+
+	// Warns the first time an allocation doesn't fit
+	void overBudget(size_t bytes, MemoryCategory category){
+		if(!_warned.exchange(true))
+			ERROR("ERROR - MEMORY - Over the budget of " << _budget << " bytes allocating " << bytes << " bytes of " << MEMORY_CATEGORY_NAMES[category]);
+	}
+
+	void printReport(){
+		PRINT("Memory (current / peak):");
+		for(int i = 0; i < MEM_CATEGORIES; i++){
+			PRINT("  " << MEMORY_CATEGORY_NAMES[i] << ": " << (_current[i] >> 10) << " KB / " << (_peak[i] >> 10) << " KB");
+		}
+		PRINT("  total: " << (_total >> 10) << " KB / " << (_total_peak >> 10) << " KB");
+		if(_budget > 0)
+			PRINT("  budget: " << (_budget >> 10) << " KB" << (_total_peak > (int64_t)_budget ? ", exceeded" : ""));
+	}
+};
+
+MemoryTracker& memoryTracker(){
+	static MemoryTracker tracker;
+	return tracker;
+}
+
+// Tracked, aligned allocation. Bails if the system is out of memory.
+void * trackedAlloc(size_t bytes, MemoryCategory category, size_t alignment = 16){
+	if(!memoryTracker().reserve(bytes))
+		memoryTracker().overBudget(bytes, category);
+
+	void * memory = nullptr;
+	if(bytes > 0 && posix_memalign(&memory, std::max(alignment, sizeof(void *)), bytes) != 0){
+		ERROR("ERROR - MEMORY - Could not allocate " << bytes << " bytes of " << MEMORY_CATEGORY_NAMES[category] << " ...bailing");
+		exit(0);
+	}
+	memoryTracker().allocated(bytes, category);
+	return memory;
+}
+
+// bytes and category must match the trackedAlloc() call
+void trackedFree(void * memory, size_t bytes, MemoryCategory category){
+	if(!memory)
+		return;
+	free(memory);
+	memoryTracker().freed(bytes, category);
+}
+
+// For standard containers holding tracked data
+template<typename T, MemoryCategory Category>
+struct TrackedAllocator{
+	typedef T value_type;
+
+	template<typename U>
+	struct rebind{typedef TrackedAllocator<U, Category> other;};
+
+	TrackedAllocator(){}
+	template<typename U>
+	TrackedAllocator(const TrackedAllocator<U, Category>&){}
+
+	T * allocate(size_t n){
+		return (T *)trackedAlloc(n*sizeof(T), Category, alignof(T));
+	}
+
+	void deallocate(T * p, size_t n){
+		trackedFree(p, n*sizeof(T), Category);
+	}
+
+	template<typename U>
+	bool operator==(const TrackedAllocator<U, Category>&) const {return true;}
+	template<typename U>
+	bool operator!=(const TrackedAllocator<U, Category>&) const {return false;}
+};
+
+// Class scope operator new/delete for small objects counted as category
+#define TRACKED_NEW(category) \
+	static void * operator new(size_t bytes){return trackedAlloc(bytes, category);} \
+	static void operator delete(void * memory, size_t bytes){trackedFree(memory, bytes, category);}
+
+#endif // MEMORY_H
@@ -0,0 +1,128 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// Persistent pool of worker threads for data parallel loops. parallelFor()
+// splits a range into chunks that the calling thread and the workers pull from
+// a shared counter. One loop runs on the pool at a time; a loop started while
+// the pool is busy (or from inside a worker) just runs on the calling thread.
+class ThreadPool{
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _wake, _done;
+	const std::function<void(int, int)> * _job;
+	int _end, _grain;
+	std::atomic<int> _next;
+	int _active;
+	unsigned _generation;
+	bool _quit;
+	std::atomic<bool> _busy;
+
+	static bool& insideWorker(){
+		static thread_local bool inside = false;
+		return inside;
+	}
+
+	void runChunks(const std::function<void(int, int)>& job){
+		while(true){
+			int begin = _next.fetch_add(_grain);
+			if(begin >= _end)
+				break;
+			job(begin, std::min(begin + _grain, _end));
+		}
+	}
+
+	void workerLoop(){
+		insideWorker() = true;
+		unsigned seen = 0;
+		while(true){
+			const std::function<void(int, int)> * job;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wake.wait(lock, [&]{return _quit || _generation != seen;});
+				if(_quit)
+					return;
+				seen = _generation;
+				job = _job;
+			}
+
+			runChunks(*job);
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			if(--_active == 0)
+				_done.notify_one();
+		}
+	}
+
+public:
+	ThreadPool(int threads = 0): _job(nullptr), _end(0), _grain(1), _next(0), _active(0), _generation(0), _quit(false), _busy(false){
+		if(threads <= 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		for(int i = 0; i < threads - 1; i++){
+			_workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+		}
+	}
+
+	~ThreadPool(){
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_wake.notify_all();
+		for(int i = 0; i < _workers.size(); i++){
+			_workers[i].join();
+		}
+	}
+
+	int getThreadCount(){return _workers.size() + 1;}
+
+	// Calls fn(chunk_begin, chunk_end) over [begin, end) in chunks of grain
+	void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& fn){
+		if(end <= begin)
+			return;
+		if(grain < 1)
+			grain = 1;
+
+		if(_workers.size() == 0 || end - begin <= grain || insideWorker() || _busy.exchange(true)){
+			fn(begin, end);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_job = &fn;
+			_end = end;
+			_grain = grain;
+			_next = begin;
+			_active = _workers.size();
+			_generation++;
+		}
+		_wake.notify_all();
+
+		runChunks(fn);
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_done.wait(lock, [&]{return _active == 0;});
+			_job = nullptr;
+		}
+		_busy = false;
+	}
+};
+
+ThreadPool& threadPool(){
+	static ThreadPool pool;
+	return pool;
+}
+
+void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& fn){
+	threadPool().parallelFor(begin, end, grain, fn);
+}
+
+#endif // PARALLEL_H
@@ -0,0 +1,461 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <EIGEN_SETTINGS.h>
+#include <math.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "layer.h"
+#include "keyframe.h"
+#include "memory.h"
+#include "simd.h"
+#include "parallel.h"
+#include "tiles.h"
+#include "composite.h"
+
+// Whole frames between saved simulation states
+#define PARTICLE_CHECKPOINT_INTERVAL 30
+
+enum ParticleStyle{
+	PARTICLE_POINTS,  // One pixel, filtered between pixels
+	PARTICLE_LINES,   // Streaks back along the velocity
+	PARTICLE_SPRITES  // An image scaled to the particle size
+};
+
+typedef std::vector<float, TrackedAllocator<float, MEM_CACHES>> ParticleArray;
+
+// Simulation state at a whole frame, one array per attribute. Arrays are
+// padded to a multiple of 8 so the update never needs a scalar tail.
+struct ParticleState{
+	int frame;
+	int count;        // Live particles
+	uint32_t emitted; // Particles ever emitted, numbers the next one
+	float carry;      // Fraction of a particle owed to the next frame
+	ParticleArray x, y, vx, vy, age, life;
+
+	void clear(int start_frame){
+		frame = start_frame;
+		count = 0;
+		emitted = 0;
+		carry = 0;
+		resize(0);
+	}
+
+	void resize(int n){
+		int padded = (n + 7) & ~7;
+		x.resize(padded); y.resize(padded);
+		vx.resize(padded); vy.resize(padded);
+		age.resize(padded); life.resize(padded);
+	}
+
+	size_t getBytes() const {
+		return (x.capacity() + y.capacity() + vx.capacity() + vy.capacity() + age.capacity() + life.capacity())*sizeof(float);
+	}
+};
+
+// Random number for one particle, depending only on the seed, which particle
+// it is and what it's for, so the simulation doesn't depend on its history
+inline float particleRandom(uint32_t seed, uint32_t id, uint32_t stream){
+	uint32_t h = seed ^ (id*0x9E3779B9u) ^ (stream*0x85EBCA6Bu);
+	h ^= h >> 16;
+	h *= 0x7FEB352Du;
+	h ^= h >> 15;
+	h *= 0x846CA68Bu;
+	h ^= h >> 16;
+	return (h >> 8)*(1.0f/16777216.0f);
+}
+
+// Emits particles from a disc and moves them under gravity and drag, one whole
+// frame per step. Layer pixel (0, 0) is the top left, y goes down.
+//
+// The state is stored as one array per attribute and stepped 8 particles at a
+// time across the thread pool. It only depends on the frame, never on which
+// frames were rendered before: every PARTICLE_CHECKPOINT_INTERVAL frames the
+// state is saved, and a frame is simulated from the nearest saved state at or
+// before it (or the live state, if that is closer). Saved states are dropped
+// first when the memory budget runs low.
+class ParticleSystem : public Layer, public MemoryEvictor{
+	uint32_t _seed;
+	int _start_frame = 0;
+	int _max_particles = 1000000;
+
+	// Not owned, same as the layer transform animators
+	Float_Animator * _emitter_x = nullptr;
+	Float_Animator * _emitter_y = nullptr;
+	Float_Animator * _rate = nullptr;
+	float _radius = 0;
+
+	float _direction = -90, _spread = 30;   // Degrees, 0 is right and -90 up
+	float _speed = 4, _speed_variation = 0; // Pixels per frame
+	float _life = 60, _life_variation = 0;  // Frames
+	float _gravity_x = 0, _gravity_y = 0;   // Pixels per frame per frame
+	float _drag = 1;                        // Velocity kept each frame
+
+	ParticleStyle _style = PARTICLE_POINTS;
+	float _streak = 1; // Frames of velocity a line trails
+	float _size = 8;   // Sprite width and height
+	ImageBuffer * _sprite = nullptr;
+	VEC3 _birth_colour, _death_colour;
+	float _opacity = 1;
+
+	std::mutex _mutex;
+	std::atomic<std::thread::id> _owner{std::thread::id()}; // Thread holding _mutex, if any
+	ParticleState _state;
+	std::map<int, ParticleState> _checkpoints;
+
+	// Per particle values for the frame being drawn
+	ParticleArray _px, _py, _tx, _ty, _r, _g, _b, _a;
+
+	static float sample(Float_Animator * animator, float frame_num, float default_value){
+		return (animator ? animator->interpolate(frame_num) : default_value);
+	}
+
+	// Holds _mutex and marks the calling thread as its owner, so that
+	// releaseMemory() called back from one of our own allocations can tell
+	struct Hold{
+		ParticleSystem& system;
+		std::lock_guard<std::mutex> lock;
+		Hold(ParticleSystem& system): system(system), lock(system._mutex){system._owner = std::this_thread::get_id();}
+		~Hold(){system._owner = std::thread::id();}
+	};
+
+	// Lock held
+	void reset(){
+		_state.clear(_start_frame);
+		_checkpoints.clear();
+	}
+
+	float random(uint32_t id, uint32_t stream){
+		return particleRandom(_seed, id, stream);
+	}
+
+	// Moves s on by one frame. Lock held.
+	void step(ParticleState& s){
+		float8 gx(_gravity_x), gy(_gravity_y), drag(_drag), one(1.0f);
+		parallelFor(0, (int)s.x.size()/8, 1024, [&](int begin, int end){
+			for(int i = begin*8; i < end*8; i += 8){
+				float8 vx = (float8::load(&s.vx[i]) + gx)*drag;
+				float8 vy = (float8::load(&s.vy[i]) + gy)*drag;
+				(float8::load(&s.x[i]) + vx).store(&s.x[i]);
+				(float8::load(&s.y[i]) + vy).store(&s.y[i]);
+				vx.store(&s.vx[i]);
+				vy.store(&s.vy[i]);
+				(float8::load(&s.age[i]) + one).store(&s.age[i]);
+			}
+		});
+
+		// Drop the dead, keeping the rest in order so they draw in the same order
+		int live = 0;
+		for(int i = 0; i < s.count; i++){
+			if(s.age[i] >= s.life[i])
+				continue;
+			if(live != i){
+				s.x[live] = s.x[i]; s.y[live] = s.y[i];
+				s.vx[live] = s.vx[i]; s.vy[live] = s.vy[i];
+				s.age[live] = s.age[i]; s.life[live] = s.life[i];
+			}
+			live++;
+		}
+		s.count = live;
+
+		// Births are spread evenly over the frame
+		float wanted = s.carry + std::max(0.0f, sample(_rate, s.frame, 0));
+		int born = (int)wanted;
+		s.carry = wanted - born;
+		born = std::max(0, std::min(born, _max_particles - s.count));
+		s.resize(s.count + born);
+		for(int k = 0; k < born; k++){
+			int i = s.count + k;
+			uint32_t id = s.emitted++;
+			float age = (k + 0.5f)/born;
+			float birth = s.frame + 1 - age;
+
+			float angle = (_direction + (random(id, 0) - 0.5f)*_spread)*(float)M_PI/180;
+			float speed = _speed*(1 + (2*random(id, 1) - 1)*_speed_variation);
+			float r = _radius*sqrtf(random(id, 2)), around = 2*(float)M_PI*random(id, 3);
+
+			s.vx[i] = cosf(angle)*speed;
+			s.vy[i] = sinf(angle)*speed;
+			s.x[i] = sample(_emitter_x, birth, 0) + r*cosf(around) + s.vx[i]*age;
+			s.y[i] = sample(_emitter_y, birth, 0) + r*sinf(around) + s.vy[i]*age;
+			s.age[i] = age;
+			s.life[i] = std::max(1.0f, _life*(1 + (2*random(id, 4) - 1)*_life_variation));
+		}
+		s.count += born;
+		s.frame++;
+	}
+
+	// State at frame (not before the start). Lock held.
+	ParticleState& stateAt(int frame){
+		auto saved = _checkpoints.upper_bound(frame);
+		int from = _start_frame;
+		if(saved != _checkpoints.begin()){
+			--saved;
+			from = saved->first;
+		}else{
+			saved = _checkpoints.end();
+		}
+
+		if(_state.frame > frame || _state.frame < from){
+			if(saved != _checkpoints.end())
+				_state = saved->second;
+			else
+				_state.clear(_start_frame);
+		}
+
+		while(_state.frame < frame){
+			step(_state);
+			if((_state.frame - _start_frame)%PARTICLE_CHECKPOINT_INTERVAL == 0 && !_checkpoints.count(_state.frame)){
+				ParticleState& checkpoint = _checkpoints[_state.frame];
+				checkpoint = _state;
+				checkpoint.resize(_state.count);
+			}
+		}
+		return _state;
+	}
+
+	// Pixel rows a particle's drawing can touch
+	void footprint(int i, int& y0, int& y1){
+		if(_style == PARTICLE_SPRITES){
+			y0 = (int)floorf(_py[i] - _size/2) - 1;
+			y1 = (int)floorf(_py[i] + _size/2) + 2;
+		}else if(_style == PARTICLE_POINTS){
+			y0 = (int)floorf(_py[i]);
+			y1 = y0 + 2;
+		}else{
+			y0 = (int)floorf(std::min(_py[i], _ty[i]));
+			y1 = (int)floorf(std::max(_py[i], _ty[i])) + 2;
+		}
+	}
+
+public:
+	ParticleSystem(uint32_t seed = 1): _seed(seed), _birth_colour(1, 1, 1), _death_colour(1, 1, 1){
+		reset();
+		memoryTracker().addEvictor(this);
+	}
+
+	~ParticleSystem(){
+		memoryTracker().removeEvictor(this);
+		delete _sprite;
+	}
+
+	// Changing anything that feeds the simulation throws away the saved states.
+	// Call invalidate() after editing the keyframes of an animator in use.
+	void invalidate(){
+		Hold hold(*this);
+		reset();
+	}
+
+	// First frame of the simulation, nothing shows before it
+	void setStartFrame(int start_frame){_start_frame = start_frame; invalidate();}
+	void setMaxParticles(int max_particles){_max_particles = max_particles; invalidate();}
+
+	// Particles are born inside a disc around (x, y). Not owned.
+	void setEmitter(Float_Animator * x, Float_Animator * y, float radius){
+		_emitter_x = x;
+		_emitter_y = y;
+		_radius = radius;
+		invalidate();
+	}
+
+	// Particles born per frame. Not owned; nullptr (the default) emits nothing.
+	void setRate(Float_Animator * per_frame){_rate = per_frame; invalidate();}
+
+	// Launch direction, and the full width of the cone around it, in degrees
+	void setDirection(float degrees, float spread){_direction = degrees; _spread = spread; invalidate();}
+
+	// Variations are a fraction either way, e.g. 0.2 for +-20%
+	void setSpeed(float pixels_per_frame, float variation){_speed = pixels_per_frame; _speed_variation = variation; invalidate();}
+	void setLifetime(float frames, float variation){_life = frames; _life_variation = variation; invalidate();}
+
+	void setGravity(float x, float y){_gravity_x = x; _gravity_y = y; invalidate();}
+	void setDrag(float kept_per_frame){_drag = kept_per_frame; invalidate();}
+
+	// Colour fades from birth to death while the opacity fades out
+	void setColours(const VEC3& birth, const VEC3& death){_birth_colour = birth; _death_colour = death;}
+	void setOpacity(float opacity){_opacity = opacity;}
+
+	void setStyle(ParticleStyle style){_style = style;}
+
+	// How many frames of movement a line trails behind
+	void setStreak(float frames){_streak = frames;}
+
+	// Draws each particle as the image (premultiplied by its alpha), size pixels across
+	void setSprite(const std::string& filename, float size){
+		delete _sprite;
+		_sprite = new ImageBuffer(filename);
+		_size = size;
+		_style = PARTICLE_SPRITES;
+	}
+
+	int getParticleCount(float frame_num){
+		if(frame_num < _start_frame)
+			return 0;
+		Hold hold(*this);
+		return stateAt((int)floorf(frame_num)).count;
+	}
+
+	size_t releaseMemory(size_t bytes){
+		// Our own allocations can end up here, with the lock already held. From
+		// another thread, don't wait: the holder may be waiting on the tracker.
+		if(_owner.load() == std::this_thread::get_id())
+			return 0;
+		std::unique_lock<std::mutex> lock(_mutex, std::try_to_lock);
+		if(!lock.owns_lock())
+			return 0;
+		size_t released = 0;
+		while(released < bytes && !_checkpoints.empty()){
+			// The saved state furthest from where playback is goes first
+			auto first = _checkpoints.begin(), last = --_checkpoints.end();
+			auto victim = (std::abs(first->first - _state.frame) > std::abs(last->first - _state.frame) ? first : last);
+			released += victim->second.getBytes();
+			_checkpoints.erase(victim);
+		}
+		return released;
+	}
+
+	// The fastest a particle can go, born at full speed and falling for its
+	// whole life, over the time between
+	float getContentMotion(float t0, float t1){
+		if(getParticleCount(t0) == 0 && getParticleCount(t1) == 0)
+			return 0;
+		float fastest = _speed*(1 + _speed_variation) + hypot(_gravity_x, _gravity_y)*_life*(1 + _life_variation);
+		return fastest*(t1 - t0);
+	}
+
+	bool tracksWrites(){return true;}
+
+	void render(const ImageView& target, float frame_num, const TileMask * coverage = nullptr){
+		if(frame_num < _start_frame || target.isEmpty())
+			return;
+
+		Hold hold(*this);
+		int whole = (int)floorf(frame_num);
+		ParticleState& s = stateAt(whole);
+		if(s.count == 0)
+			return;
+
+		// Between whole frames particles carry on in a straight line
+		float fraction = frame_num - whole;
+		size_t padded = s.x.size();
+		_px.resize(padded); _py.resize(padded); _tx.resize(padded); _ty.resize(padded);
+		_r.resize(padded); _g.resize(padded); _b.resize(padded); _a.resize(padded);
+
+		float8 f(fraction), trail(fraction - _streak), zero(0.0f), one(1.0f), opacity(_opacity);
+		float8 r0(_birth_colour[0]), g0(_birth_colour[1]), b0(_birth_colour[2]);
+		float8 dr(_death_colour[0] - _birth_colour[0]), dg(_death_colour[1] - _birth_colour[1]), db(_death_colour[2] - _birth_colour[2]);
+		parallelFor(0, (int)padded/8, 1024, [&](int begin, int end){
+			for(int i = begin*8; i < end*8; i += 8){
+				float8 x = float8::load(&s.x[i]), y = float8::load(&s.y[i]);
+				float8 vx = float8::load(&s.vx[i]), vy = float8::load(&s.vy[i]);
+				(x + vx*f).store(&_px[i]);
+				(y + vy*f).store(&_py[i]);
+				(x + vx*trail).store(&_tx[i]);
+				(y + vy*trail).store(&_ty[i]);
+
+				float8 t = min((float8::load(&s.age[i]) + f)/float8::load(&s.life[i]), one);
+				float8 a = max(one - t, zero)*opacity;
+				((r0 + dr*t)*a).store(&_r[i]);
+				((g0 + dg*t)*a).store(&_g[i]);
+				((b0 + db*t)*a).store(&_b[i]);
+				a.store(&_a[i]);
+			}
+		});
+
+		// Sort particles into the tile rows they touch, keeping their order, so
+		// every row can be drawn on its own thread
+		int ty0 = tileOf(target.getY0()), ty1 = tileOf(target.getY1() - 1);
+		std::vector<std::vector<int>> rows(ty1 - ty0 + 1);
+		for(int i = 0; i < s.count; i++){
+			if(_a[i] <= 0)
+				continue;
+			int y0, y1;
+			footprint(i, y0, y1);
+			y0 = std::max(y0, target.getY0());
+			y1 = std::min(y1, target.getY1());
+			if(y1 <= y0)
+				continue;
+			for(int ty = tileOf(y0); ty <= tileOf(y1 - 1); ty++){
+				rows[ty - ty0].push_back(i);
+			}
+		}
+
+		int tx0 = tileOf(target.getX0()), tilesX = tileOf(target.getX1() - 1) - tx0 + 1;
+		ImageView sprite = (_sprite ? _sprite->view() : ImageView());
+		std::vector<uint8_t> touched(rows.size()*tilesX, 0);
+		parallelFor(0, (int)rows.size(), 1, [&](int begin, int end){
+			for(int row = begin; row < end; row++){
+				int y0 = std::max((ty0 + row)*TILE_SIZE, target.getY0());
+				int y1 = std::min((ty0 + row + 1)*TILE_SIZE, target.getY1());
+				uint8_t * rowTouched = &touched[row*tilesX];
+
+				auto plot = [&](int x, int y, const float4& src){
+					if(y < y0 || y >= y1 || x < target.getX0() || x >= target.getX1())
+						return;
+					if(coverage && !coverage->covers(x, y))
+						return;
+					Pixel& p = target.row(y)[x - target.getX0()];
+					p.set(src + p.toFloat4()*(float4(1.0f) - src.splatW()));
+					rowTouched[tileOf(x) - tx0] = 1;
+				};
+				// Spreads src over the 4 pixels around (x, y)
+				auto splat = [&](float x, float y, const float4& src){
+					int ix = (int)floorf(x), iy = (int)floorf(y);
+					float fx = x - ix, fy = y - iy;
+					plot(ix, iy, src*float4((1 - fx)*(1 - fy)));
+					plot(ix + 1, iy, src*float4(fx*(1 - fy)));
+					plot(ix, iy + 1, src*float4((1 - fx)*fy));
+					plot(ix + 1, iy + 1, src*float4(fx*fy));
+				};
+
+				const std::vector<int>& particles = rows[row];
+				for(int n = 0; n < particles.size(); n++){
+					int i = particles[n];
+					float rgba[4] = {_r[i], _g[i], _b[i], _a[i]};
+					float4 colour = float4::load(rgba);
+
+					if(_style == PARTICLE_POINTS){
+						splat(_px[i], _py[i], colour);
+					}else if(_style == PARTICLE_LINES){
+						float dx = _px[i] - _tx[i], dy = _py[i] - _ty[i];
+						int steps = std::max(1, (int)ceilf(sqrtf(dx*dx + dy*dy)));
+						for(int k = 1; k <= steps; k++){
+							splat(_tx[i] + dx*k/steps, _ty[i] + dy*k/steps, colour);
+						}
+					}else if(_sprite){
+						// Bilinear over the sprite, pixel centres mapped across
+						float left = _px[i] - _size/2, top = _py[i] - _size/2;
+						float scaleX = sprite.getWidth()/_size, scaleY = sprite.getHeight()/_size;
+						int x0 = (int)floorf(left), x1 = (int)floorf(left + _size) + 1;
+						for(int y = std::max((int)floorf(top), y0); y < std::min((int)floorf(top + _size) + 1, y1); y++){
+							float v = (y - top)*scaleY - 0.5f;
+							int iv = (int)floorf(v);
+							float fv = v - iv;
+							for(int x = x0; x <= x1; x++){
+								float u = (x - left)*scaleX - 0.5f;
+								int iu = (int)floorf(u);
+								float fu = u - iu;
+								float4 texel = fetchTexel(sprite, iu, iv)*float4((1 - fu)*(1 - fv)) + fetchTexel(sprite, iu + 1, iv)*float4(fu*(1 - fv))
+									+ fetchTexel(sprite, iu, iv + 1)*float4((1 - fu)*fv) + fetchTexel(sprite, iu + 1, iv + 1)*float4(fu*fv);
+								plot(x, y, texel*colour);
+							}
+						}
+					}
+				}
+			}
+		});
+
+		for(int row = 0; row < rows.size(); row++){
+			for(int tx = 0; tx < tilesX; tx++){
+				if(touched[row*tilesX + tx])
+					target.markWritten((tx0 + tx)*TILE_SIZE, (ty0 + row)*TILE_SIZE, (tx0 + tx + 1)*TILE_SIZE, (ty0 + row + 1)*TILE_SIZE);
+			}
+		}
+	}
+};
+
+#endif // PARTICLES_H
@@ -0,0 +1,383 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <EIGEN_SETTINGS.h>
+#include <math.h>
+#include <algorithm>
+#include "layer.h"
+#include "simd.h"
+#include "parallel.h"
+#include "tiles.h"
+
+enum FillRule{
+	FILL_NONZERO,
+	FILL_EVEN_ODD
+};
+
+// One straight piece of a flattened outline, top to bottom
+struct PathEdge{
+	float x0, y0, x1, y1;
+	float slope; // dx/dy
+	int winding; // +1 if the outline runs down here, -1 if up
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////PATH///////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Outline made of lines and Bezier curves in layer pixels, y down. Every
+// subpath is closed when it's filled, whether or not close() was called.
+class Path{
+	enum Verb{MOVE, LINE, QUAD, CUBIC, CLOSE};
+
+	std::vector<Verb> _verbs;
+	std::vector<VEC2> _points; // 1 per MOVE and LINE, 2 per QUAD, 3 per CUBIC
+
+	static double distanceToChord(const VEC2& p, const VEC2& a, const VEC2& b){
+		VEC2 chord = b - a, offset = p - a;
+		double length = chord.norm();
+		if(length < 1e-9)
+			return offset.norm();
+		return fabs(chord[0]*offset[1] - chord[1]*offset[0])/length;
+	}
+
+	// Splits in half until the control points are within tolerance of the
+	// chord, so flat parts take few edges and tight bends take many
+	static void flattenCubic(const VEC2& p0, const VEC2& p1, const VEC2& p2, const VEC2& p3,
+		float tolerance, int depth, std::vector<VEC2>& out){
+		if(depth >= 16 || std::max(distanceToChord(p1, p0, p3), distanceToChord(p2, p0, p3)) <= tolerance){
+			out.push_back(p3);
+			return;
+		}
+		VEC2 p01 = (p0 + p1)/2, p12 = (p1 + p2)/2, p23 = (p2 + p3)/2;
+		VEC2 p012 = (p01 + p12)/2, p123 = (p12 + p23)/2;
+		VEC2 mid = (p012 + p123)/2;
+		flattenCubic(p0, p01, p012, mid, tolerance, depth + 1, out);
+		flattenCubic(mid, p123, p23, p3, tolerance, depth + 1, out);
+	}
+
+	static void addEdge(const VEC2& a, const VEC2& b, std::vector<PathEdge>& edges){
+		if(a[1] == b[1])
+			return;
+		PathEdge edge;
+		bool down = (a[1] < b[1]);
+		const VEC2& top = (down ? a : b);
+		const VEC2& bottom = (down ? b : a);
+		edge.x0 = top[0]; edge.y0 = top[1];
+		edge.x1 = bottom[0]; edge.y1 = bottom[1];
+		edge.slope = (edge.x1 - edge.x0)/(edge.y1 - edge.y0);
+		edge.winding = (down ? 1 : -1);
+		edges.push_back(edge);
+	}
+
+	// Closes the polyline started at outline[0]
+	static void closeOutline(std::vector<VEC2>& outline, std::vector<PathEdge>& edges){
+		for(int i = 1; i < outline.size(); i++){
+			addEdge(outline[i - 1], outline[i], edges);
+		}
+		if(outline.size() > 2)
+			addEdge(outline.back(), outline[0], edges);
+		outline.clear();
+	}
+
+	VEC2 current(){
+		if(_points.empty()){
+			ERROR("ERROR - PATH - Path has to start with moveTo()");
+			return VEC2(0, 0);
+		}
+		return _points.back();
+	}
+
+public:
+	Path& moveTo(const VEC2& p){
+		_verbs.push_back(MOVE);
+		_points.push_back(p);
+		return *this;
+	}
+
+	Path& lineTo(const VEC2& p){
+		current();
+		_verbs.push_back(LINE);
+		_points.push_back(p);
+		return *this;
+	}
+
+	Path& quadTo(const VEC2& control, const VEC2& p){
+		current();
+		_verbs.push_back(QUAD);
+		_points.push_back(control);
+		_points.push_back(p);
+		return *this;
+	}
+
+	Path& cubicTo(const VEC2& control_1, const VEC2& control_2, const VEC2& p){
+		current();
+		_verbs.push_back(CUBIC);
+		_points.push_back(control_1);
+		_points.push_back(control_2);
+		_points.push_back(p);
+		return *this;
+	}
+
+	Path& close(){
+		_verbs.push_back(CLOSE);
+		return *this;
+	}
+
+	bool isEmpty(){return _points.empty();}
+
+	// Edges of the outline, curves within tolerance pixels, sorted by their top
+	std::vector<PathEdge> flatten(float tolerance) const {
+		std::vector<PathEdge> edges;
+		std::vector<VEC2> outline;
+		int p = 0;
+		for(int i = 0; i < _verbs.size(); i++){
+			switch(_verbs[i]){
+			case MOVE:
+				closeOutline(outline, edges);
+				outline.push_back(_points[p++]);
+				break;
+			case LINE:
+				outline.push_back(_points[p++]);
+				break;
+			case QUAD:{
+				// Raised to a cubic with the same shape
+				VEC2 from = outline.back();
+				VEC2 c1 = from + (_points[p] - from)*(2.0/3), c2 = _points[p + 1] + (_points[p] - _points[p + 1])*(2.0/3);
+				flattenCubic(from, c1, c2, _points[p + 1], tolerance, 0, outline);
+				p += 2;
+				break;
+			}
+			case CUBIC:
+				flattenCubic(outline.back(), _points[p], _points[p + 1], _points[p + 2], tolerance, 0, outline);
+				p += 3;
+				break;
+			case CLOSE:{
+				VEC2 start = outline.empty() ? VEC2(0, 0) : outline[0];
+				closeOutline(outline, edges);
+				// Drawing carries on from the start of the closed subpath
+				outline.push_back(start);
+				break;
+			}
+			}
+		}
+		closeOutline(outline, edges);
+
+		std::sort(edges.begin(), edges.end(), [](const PathEdge& a, const PathEdge& b){return a.y0 < b.y0;});
+		return edges;
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////PATHS LAYER////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Filled paths, drawn in the order they were added. Each path is flattened
+// once when it's added; drawing walks the edges down the layer with an active
+// edge table, so the cost goes with the number of edges and the length of the
+// spans they bound, not with paths times pixels.
+//
+// With antialiasing, each pixel row is sampled on several sub-rows and each
+// span's exact horizontal coverage is summed, giving coverage to about
+// 1/samples vertically. Without it, a pixel is filled if its centre is inside.
+class Paths : public Layer{
+	struct FilledPath{
+		std::vector<PathEdge> edges;
+		float colour[4];
+		FillRule rule;
+		float top, bottom;
+	};
+
+	std::vector<FilledPath> _paths;
+	float _tolerance;
+	int _samples;
+
+	// Fills one path over the tile row of target [y0, y1)
+	void fillBand(const FilledPath& path, const ImageView& target, int y0, int y1, const TileMask * coverage,
+		std::vector<float>& cover, std::vector<float>& area, int& touched_x0, int& touched_x1){
+		int x0 = target.getX0(), x1 = target.getX1();
+		float4 colour = float4::load(path.colour);
+		float weight = 1.0f/_samples;
+
+		// Edges crossing the band, still in order of their tops
+		std::vector<const PathEdge *> pending;
+		for(int i = 0; i < path.edges.size() && path.edges[i].y0 < y1; i++){
+			if(path.edges[i].y1 > y0)
+				pending.push_back(&path.edges[i]);
+		}
+		if(pending.empty())
+			return;
+
+		struct Crossing{
+			float x;
+			int winding;
+		};
+		std::vector<const PathEdge *> active;
+		std::vector<Crossing> crossings;
+		int next = 0;
+
+		for(int y = y0; y < y1; y++){
+			int span_x0 = x1, span_x1 = x0;
+			for(int s = 0; s < _samples; s++){
+				float sy = y + (s + 0.5f)/_samples;
+
+				while(next < pending.size() && pending[next]->y0 <= sy){
+					active.push_back(pending[next++]);
+				}
+				active.erase(std::remove_if(active.begin(), active.end(), [&](const PathEdge * e){return e->y1 <= sy;}), active.end());
+				if(active.empty())
+					continue;
+
+				crossings.clear();
+				for(int i = 0; i < active.size(); i++){
+					if(active[i]->y0 > sy)
+						continue;
+					Crossing c;
+					c.x = active[i]->x0 + (sy - active[i]->y0)*active[i]->slope;
+					c.winding = active[i]->winding;
+					crossings.push_back(c);
+				}
+				// Mostly in order already from the last sub-row
+				for(int i = 1; i < crossings.size(); i++){
+					Crossing c = crossings[i];
+					int j = i - 1;
+					while(j >= 0 && crossings[j].x > c.x){
+						crossings[j + 1] = crossings[j];
+						j--;
+					}
+					crossings[j + 1] = c;
+				}
+
+				int winding = 0;
+				for(int i = 0; i + 1 < crossings.size(); i++){
+					winding += crossings[i].winding;
+					bool inside = (path.rule == FILL_NONZERO ? winding != 0 : (winding & 1) != 0);
+					if(!inside)
+						continue;
+
+					float xa = crossings[i].x, xb = crossings[i + 1].x;
+					if(_samples == 1){
+						// Whole pixels whose centres are inside
+						xa = ceilf(xa - 0.5f);
+						xb = ceilf(xb - 0.5f);
+					}
+					xa = std::max(xa, (float)x0);
+					xb = std::min(xb, (float)x1);
+					if(xb <= xa)
+						continue;
+
+					// Whole pixels go in cover as a step up and back down, the
+					// partial ones at each end straight into area
+					int ia = (int)floorf(xa), ib = (int)floorf(xb);
+					if(ia == ib){
+						area[ia - x0] += (xb - xa)*weight;
+					}else{
+						area[ia - x0] += (ia + 1 - xa)*weight;
+						area[ib - x0] += (xb - ib)*weight;
+						cover[ia + 1 - x0] += weight;
+						cover[ib - x0] -= weight;
+					}
+					span_x0 = std::min(span_x0, ia);
+					span_x1 = std::max(span_x1, std::min(ib + 1, x1));
+				}
+			}
+			if(span_x1 <= span_x0)
+				continue;
+
+			Pixel * row = target.row(y) - x0;
+			auto blendSpan = [&](int run_x0, int run_x1){
+				float running = 0;
+				for(int x = span_x0; x < run_x0; x++){
+					running += cover[x - x0];
+				}
+				for(int x = run_x0; x < run_x1; x++){
+					running += cover[x - x0];
+					float alpha = std::min(running + area[x - x0], 1.0f);
+					if(alpha <= 0)
+						continue;
+					float4 src = colour*float4(alpha);
+					row[x].set(src + row[x].toFloat4()*(float4(1.0f) - src.splatW()));
+				}
+			};
+			if(coverage)
+				coverage->forEachRun(y, span_x0, span_x1, blendSpan);
+			else
+				blendSpan(span_x0, span_x1);
+
+			// cover's step down can sit one past the span
+			std::fill(cover.begin() + (span_x0 - x0), cover.begin() + (std::min(span_x1 + 1, x1) - x0) + 1, 0.0f);
+			std::fill(area.begin() + (span_x0 - x0), area.begin() + (span_x1 - x0), 0.0f);
+			touched_x0 = std::min(touched_x0, span_x0);
+			touched_x1 = std::max(touched_x1, span_x1);
+		}
+	}
+
+public:
+	// Curves are flattened to within tolerance pixels; samples sub-rows per
+	// pixel row, 1 for no antialiasing
+	Paths(float tolerance = 0.2f, int samples = 4): _tolerance(tolerance), _samples(std::max(1, samples)){}
+
+	// colour is 0 to 1
+	void addPath(const Path& path, const VEC3& colour, FillRule rule = FILL_NONZERO){
+		FilledPath filled;
+		filled.edges = path.flatten(_tolerance);
+		if(filled.edges.empty())
+			return;
+		for(int c = 0; c < 3; c++){
+			filled.colour[c] = colour[c];
+		}
+		filled.colour[3] = 1;
+		filled.rule = rule;
+		filled.top = filled.edges[0].y0;
+		filled.bottom = filled.edges[0].y1;
+		for(int i = 1; i < filled.edges.size(); i++){
+			filled.bottom = std::max(filled.bottom, filled.edges[i].y1);
+		}
+		_paths.push_back(filled);
+	}
+
+	int getEdgeCount(){
+		int count = 0;
+		for(int i = 0; i < _paths.size(); i++){
+			count += _paths[i].edges.size();
+		}
+		return count;
+	}
+
+	bool tracksWrites(){return true;}
+
+	void render(const ImageView& target, float frame_num, const TileMask * coverage = nullptr){
+		if(target.isEmpty())
+			return;
+
+		// One tile row per task so the written tiles can be marked per row
+		int ty0 = tileOf(target.getY0()), rows = tileOf(target.getY1() - 1) - ty0 + 1;
+		for(int p = 0; p < _paths.size(); p++){
+			const FilledPath& path = _paths[p];
+			std::vector<int> touched(rows*2);
+			parallelFor(0, rows, 1, [&](int begin, int end){
+				std::vector<float> cover(target.getWidth() + 2, 0), area(target.getWidth() + 2, 0);
+				for(int row = begin; row < end; row++){
+					int y0 = std::max((ty0 + row)*TILE_SIZE, target.getY0());
+					int y1 = std::min((ty0 + row + 1)*TILE_SIZE, target.getY1());
+					int& touched_x0 = touched[row*2];
+					int& touched_x1 = touched[row*2 + 1];
+					touched_x0 = target.getX1();
+					touched_x1 = target.getX0();
+					if(path.bottom <= y0 || path.top >= y1)
+						continue;
+					if(coverage && !coverage->any(target.getX0(), y0, target.getX1(), y1))
+						continue;
+					fillBand(path, target, y0, y1, coverage, cover, area, touched_x0, touched_x1);
+				}
+			});
+
+			for(int row = 0; row < rows; row++){
+				if(touched[row*2] < touched[row*2 + 1])
+					target.markWritten(touched[row*2], (ty0 + row)*TILE_SIZE, touched[row*2 + 1], (ty0 + row + 1)*TILE_SIZE);
+			}
+		}
+	}
+};
+
+#endif // PATH_H
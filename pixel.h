@@ -2,6 +2,7 @@
 #define PIXEL_H
 
 #include <EIGEN_SETTINGS.h>
+#include "simd.h"
 
 class Pixel{
 	float _r, _g, _b, _a;
@@ -10,10 +11,10 @@ public:
 	Pixel(float r, float g, float b): _r(r), _g(g), _b(b), _a(1) {}
 	Pixel(): _r(0), _g(0), _b(0), _a(1) {}
 
-	float getR() {return _r;}
-	float getG() {return _g;}
-	float getB() {return _b;}
-	float getA() {return _a;}
+	float getR() const {return _r;}
+	float getG() const {return _g;}
+	float getB() const {return _b;}
+	float getA() const {return _a;}
 	void setR(float r) {_r = r;}
 	void setG(float g) {_g = g;}
 	void setB(float b) {_b = b;}
@@ -76,6 +77,15 @@ public:
 	VEC4 toVec4(){
 		return VEC4(_r, _g, _b, _a);
 	}
+
+	// Packed RGBA, for SIMD code
+	float4 toFloat4() const {
+		return float4::load(&_r);
+	}
+
+	void set(const float4& col){
+		col.store(&_r);
+	}
 };
 
 #endif // PIXEL_H
\ No newline at end of file
@@ -0,0 +1,320 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <EIGEN_SETTINGS.h>
+#include <stdio.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "comp.h"
+#include "quantize.h"
+#include "tiff_writer.h"
+
+// RAM preview: a long running alternative to renderCompToFolder for review.
+// Frames are quantized as they would be written and kept in memory under a
+// byte budget. A background thread renders the uncached frames nearest the
+// playhead first, ahead of it before behind it, and evicts the frames furthest
+// from it when the budget runs out. Each frame is rendered in bands so that a
+// playhead jump can abandon a frame that is no longer wanted part way through.
+//
+// Frame memory counts as MEM_CACHES, and the cache gives frames up (furthest
+// from the playhead first) when the global memory budget runs low.
+//
+// Frames render one at a time because layers keep per frame state while they
+// render (Shapes sets up its triangles for the frame, for example); each frame
+// is still spread over the thread pool.
+
+typedef std::vector<uint8_t, TrackedAllocator<uint8_t, MEM_CACHES>> PreviewPixels;
+typedef std::shared_ptr<const PreviewPixels> PreviewFrame;
+
+#define PREVIEW_BAND_HEIGHT 64
+
+class PreviewCache : public MemoryEvictor{
+	Comp * _comp;
+	int _start_frame, _end_frame;
+	int _xRes, _yRes;
+	OutputFormat _format;
+	size_t _budget, _frame_bytes;
+	int _ahead, _behind;
+
+	std::mutex _mutex;
+	std::condition_variable _wake, _ready;
+	std::map<int, PreviewFrame> _frames;
+	int _playhead;
+	unsigned _generation; // Bumped on every seek
+	bool _quit;
+	std::thread _renderer;
+
+	// Order the renderer fills frames in: playhead, +1, -1, +2, -2, ... within the
+	// window, -1 outside it. Lower is more wanted.
+	int rank(int frame){
+		if(frame < _start_frame || frame >= _end_frame)
+			return -1;
+		if(frame >= _playhead)
+			return (frame - _playhead <= _ahead ? 2*(frame - _playhead) : -1);
+		return (_playhead - frame <= _behind ? 2*(_playhead - frame) - 1 : -1);
+	}
+
+	// Most wanted uncached frame that is worth making room for, or -1. Lock held.
+	int nextFrame(){
+		int wanted = -1;
+		for(int d = 0; d <= std::max(_ahead, _behind) && wanted < 0; d++){
+			if(d <= _ahead && rank(_playhead + d) >= 0 && !_frames.count(_playhead + d))
+				wanted = _playhead + d;
+			else if(d > 0 && d <= _behind && rank(_playhead - d) >= 0 && !_frames.count(_playhead - d))
+				wanted = _playhead - d;
+		}
+		// The frame at the playhead renders whatever the budget says, same as
+		// any other tracked allocation, or fetch() would wait on it forever
+		bool full = ((_frames.size() + 1)*_frame_bytes > _budget || memoryTracker().getAvailable() < _frame_bytes);
+		if(wanted < 0 || !full || wanted == _playhead)
+			return wanted;
+
+		// Full: only worth it if something less wanted can go
+		int worst = leastWanted();
+		if(worst >= 0 && (rank(worst) < 0 || rank(worst) > rank(wanted)))
+			return wanted;
+		return -1;
+	}
+
+	// Cached frame to evict first. Lock held.
+	int leastWanted(){
+		int worst = -1, worstRank = -1;
+		for(auto& entry : _frames){
+			int r = rank(entry.first);
+			if(r < 0)
+				return entry.first;
+			if(r > worstRank){
+				worst = entry.first;
+				worstRank = r;
+			}
+		}
+		return worst;
+	}
+
+	void renderLoop(){
+		int bandHeight = std::min(PREVIEW_BAND_HEIGHT, _yRes);
+		ImageBuffer band(_xRes, bandHeight);
+		size_t rowBytes = (size_t)_xRes*3*_format.bytesPerSample();
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		while(true){
+			int frame;
+			_wake.wait(lock, [&]{return _quit || (frame = nextFrame()) >= 0;});
+			if(_quit)
+				return;
+
+			// Make room up front when it's the global budget that is short, if a
+			// less wanted frame that nobody else holds can go
+			if(memoryTracker().getAvailable() < _frame_bytes && !_frames.empty()){
+				int worst = leastWanted();
+				if((rank(worst) < 0 || rank(worst) > rank(frame)) && _frames[worst].use_count() == 1)
+					_frames.erase(worst);
+			}
+
+			unsigned generation = _generation;
+			lock.unlock();
+
+			std::shared_ptr<PreviewPixels> pixels(new PreviewPixels(_frame_bytes));
+			bool abandoned = false;
+			for(int y0 = 0; y0 < _yRes && !abandoned; y0 += bandHeight){
+				int rows = std::min(bandHeight, _yRes - y0);
+				ImageView view = band.view(0, 0, _xRes, rows).placed(0, y0, _xRes, _yRes);
+				view.clear();
+				_comp->render(view, frame);
+				quantizeRows(view.row(y0), view.getStride(), _xRes, rows, y0, _format, pixels->data() + y0*rowBytes);
+
+				// Carry on through a seek only if this is still the frame to render next
+				lock.lock();
+				if(_generation != generation){
+					generation = _generation;
+					abandoned = (_quit || nextFrame() != frame);
+				}
+				lock.unlock();
+			}
+
+			lock.lock();
+			if(abandoned)
+				continue;
+
+			_frames[frame] = pixels;
+			while(_frames.size()*_frame_bytes > _budget && _frames.size() > 1){
+				_frames.erase(leastWanted());
+			}
+			_ready.notify_all();
+		}
+	}
+
+public:
+	// Keeps at most budget_bytes of frames, rendering up to frames_ahead frames
+	// after the playhead and frames_behind before it
+	PreviewCache(Comp * comp, int start_frame, int end_frame, size_t budget_bytes,
+		const OutputFormat& format = OutputFormat(), int frames_ahead = 60, int frames_behind = 15):
+		_comp(comp), _start_frame(start_frame), _end_frame(end_frame), _format(format),
+		_budget(budget_bytes), _ahead(frames_ahead), _behind(frames_behind),
+		_playhead(start_frame), _generation(0), _quit(false){
+		comp->getDimensions(_xRes, _yRes);
+		_frame_bytes = (size_t)_xRes*_yRes*3*format.bytesPerSample();
+		if(_budget < _frame_bytes){
+			ERROR("ERROR - PREVIEW - Budget of " << budget_bytes << " bytes is less than one frame, caching one frame");
+			_budget = _frame_bytes;
+		}
+		_renderer = std::thread(&PreviewCache::renderLoop, this);
+		memoryTracker().addEvictor(this);
+	}
+
+	~PreviewCache(){
+		memoryTracker().removeEvictor(this);
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_wake.notify_all();
+		_renderer.join();
+	}
+
+	void getDimensions(int& x, int& y){
+		x = _xRes;
+		y = _yRes;
+	}
+
+	const OutputFormat& getFormat(){return _format;}
+	int getStartFrame(){return _start_frame;}
+	int getEndFrame(){return _end_frame;}
+
+	void seek(int frame){
+		std::lock_guard<std::mutex> lock(_mutex);
+		_playhead = std::max(_start_frame, std::min(frame, _end_frame - 1));
+		_generation++;
+		_wake.notify_all();
+		// A fetch() waiting on another frame gives up
+		_ready.notify_all();
+	}
+
+	int getPlayhead(){
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _playhead;
+	}
+
+	// Packed RGB rows of frame if it is cached, otherwise null. Never blocks on rendering.
+	PreviewFrame tryFetch(int frame){
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto found = _frames.find(frame);
+		return (found == _frames.end() ? PreviewFrame() : found->second);
+	}
+
+	// Packed RGB rows of frame, moving the playhead there and waiting for it if
+	// it isn't cached yet. Null if frame is out of range, or if the playhead
+	// is moved elsewhere before it's ready.
+	PreviewFrame fetch(int frame){
+		if(frame < _start_frame || frame >= _end_frame)
+			return PreviewFrame();
+
+		PreviewFrame cached = tryFetch(frame);
+		if(cached)
+			return cached;
+
+		seek(frame);
+		std::unique_lock<std::mutex> lock(_mutex);
+		_ready.wait(lock, [&]{return _frames.count(frame) || _playhead != frame;});
+		auto found = _frames.find(frame);
+		return (found == _frames.end() ? PreviewFrame() : found->second);
+	}
+
+	// Gives up frames furthest from the playhead, never the one at it. A frame
+	// a caller still holds leaves the cache but only counts once they let go.
+	size_t releaseMemory(size_t bytes){
+		std::lock_guard<std::mutex> lock(_mutex);
+		size_t released = 0;
+		while(released < bytes && _frames.size() > 0){
+			int worst = leastWanted();
+			if(rank(worst) == 0)
+				break;
+			if(_frames[worst].use_count() == 1)
+				released += _frame_bytes;
+			_frames.erase(worst);
+		}
+		return released;
+	}
+
+	void getStats(int& frames, size_t& bytes){
+		std::lock_guard<std::mutex> lock(_mutex);
+		frames = _frames.size();
+		bytes = _frames.size()*_frame_bytes;
+	}
+};
+
+// Line based command interface to a PreviewCache on stdin/stdout:
+//   seek N       move the playhead, prints "ok N"
+//   get N        prints "frame N width height bits bytes" then the packed RGB
+//                rows, waiting for the frame to render if needed
+//   save N file  writes frame N to a TIFF, prints "ok N"
+//   status       prints "status playhead cached_frames cached_bytes"
+//   quit
+// Errors are printed as "error message".
+void runPreviewServer(Comp * comp, int start_frame, int end_frame, size_t budget_bytes,
+	const OutputFormat& format = OutputFormat()){
+	PreviewCache cache(comp, start_frame, end_frame, budget_bytes, format);
+	int xRes, yRes;
+	cache.getDimensions(xRes, yRes);
+
+	std::string line;
+	while(std::getline(std::cin, line)){
+		std::istringstream in(line);
+		std::string command;
+		in >> command;
+
+		if(command == "seek"){
+			int frame;
+			if(!(in >> frame)){
+				std::cout << "error seek needs a frame" << std::endl;
+				continue;
+			}
+			cache.seek(frame);
+			std::cout << "ok " << cache.getPlayhead() << std::endl;
+		}else if(command == "get" || command == "save"){
+			int frame;
+			std::string filename;
+			if(!(in >> frame) || (command == "save" && !(in >> filename))){
+				std::cout << "error " << command << " needs a frame" << (command == "save" ? " and a file" : "") << std::endl;
+				continue;
+			}
+
+			PreviewFrame pixels = cache.fetch(frame);
+			if(!pixels){
+				std::cout << "error frame " << frame << " is outside " << start_frame << " to " << end_frame << std::endl;
+				continue;
+			}
+
+			if(command == "get"){
+				std::cout << "frame " << frame << " " << xRes << " " << yRes << " " << format.bits << " " << pixels->size() << "\n";
+				std::cout.write((const char *)pixels->data(), pixels->size());
+				std::cout.flush();
+			}else{
+				TIFFStripWriter writer;
+				if(writer.open(filename, xRes, yRes, format.bits, yRes)){
+					writer.writeStrip(pixels->data(), yRes);
+					writer.close();
+					std::cout << "ok " << frame << std::endl;
+				}else{
+					std::cout << "error could not write " << filename << std::endl;
+				}
+			}
+		}else if(command == "status"){
+			int frames;
+			size_t bytes;
+			cache.getStats(frames, bytes);
+			std::cout << "status " << cache.getPlayhead() << " " << frames << " " << bytes << std::endl;
+		}else if(command == "quit"){
+			break;
+		}else if(!command.empty()){
+			std::cout << "error unknown command " << command << std::endl;
+		}
+	}
+}
+
+#endif // PREVIEW_H
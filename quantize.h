@@ -0,0 +1,297 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <EIGEN_SETTINGS.h>
+#include <stdint.h>
+#include <random>
+#include "pixel.h"
+#include "simd.h"
+#include "parallel.h"
+
+// Float to integer output stage. Each row is encoded through the transfer
+// function, dithered, clamped and truncated in 8-wide SIMD (two RGBA pixels
+// per vector), and rows are spread over the thread pool.
+
+#define TRANSFER_LUT_SIZE 16384
+#define DITHER_SIZE 64
+
+enum TransferFunction{
+	TRANSFER_LINEAR,
+	TRANSFER_SRGB,
+	TRANSFER_REC709
+};
+
+enum DitherMode{
+	DITHER_NONE,      // Truncate, same as the original writer
+	DITHER_ORDERED,   // 8x8 Bayer matrix
+	DITHER_BLUE_NOISE // 64x64 void-and-cluster mask
+};
+
+// How frame files are stored. LZ4 isn't a TIFF compression: those frames go
+// in a raw .lz4 file meant for intermediate caches (see LZ4FrameWriter).
+enum Compression{
+	COMPRESS_NONE,
+	COMPRESS_PACKBITS,
+	COMPRESS_DEFLATE, // With horizontal differencing
+	COMPRESS_LZ4
+};
+
+struct OutputFormat{
+	int bits; // 8 or 16
+	TransferFunction transfer;
+	DitherMode dither;
+	Compression compression;
+
+	OutputFormat(int bits_in = 8, TransferFunction transfer_in = TRANSFER_LINEAR, DitherMode dither_in = DITHER_NONE,
+		Compression compression_in = COMPRESS_NONE):
+		bits(bits_in), transfer(transfer_in), dither(dither_in), compression(compression_in){}
+
+	int bytesPerSample() const {return bits/8;}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////TRANSFER LUTS/////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+float encodeTransfer(TransferFunction transfer, float linear){
+	if(transfer == TRANSFER_SRGB){
+		if(linear <= 0.0031308f)
+			return 12.92f*linear;
+		return 1.055f*pow(linear, 1/2.4f) - 0.055f;
+	}else if(transfer == TRANSFER_REC709){
+		if(linear < 0.018f)
+			return 4.5f*linear;
+		return 1.099f*pow(linear, 0.45f) - 0.099f;
+	}
+	return linear;
+}
+
+// Samples of the encoding curve over [0, 1], read with linear interpolation.
+// Two extra entries so that index+1 stays in range at exactly 1.0.
+class TransferLUT{
+	float _table[TRANSFER_LUT_SIZE + 2];
+public:
+	TransferLUT(TransferFunction transfer){
+		for(int i = 0; i <= TRANSFER_LUT_SIZE; i++){
+			_table[i] = encodeTransfer(transfer, (float)i/TRANSFER_LUT_SIZE);
+		}
+		_table[TRANSFER_LUT_SIZE + 1] = _table[TRANSFER_LUT_SIZE];
+	}
+
+	const float * getTable() const {return _table;}
+
+	static const TransferLUT& get(TransferFunction transfer){
+		if(transfer == TRANSFER_REC709){
+			static TransferLUT rec709(TRANSFER_REC709);
+			return rec709;
+		}
+		static TransferLUT srgb(TRANSFER_SRGB);
+		return srgb;
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////DITHER TABLES/////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Per pixel thresholds in [0, 1) laid out as DITHER_SIZE rows of DITHER_SIZE
+// RGBA quads, so two neighbouring pixels' thresholds load as one float8.
+class DitherTable{
+	float _table[DITHER_SIZE*DITHER_SIZE*4];
+
+	// Void-and-cluster (Ulichney 1993) ranking of a toroidal DITHER_SIZE^2 grid
+	static void blueNoiseRanks(std::vector<int>& rank){
+		const int n = DITHER_SIZE*DITHER_SIZE;
+		const float sigma = 1.5f;
+
+		// Gaussian energy contributed by a point at toroidal offset (dx, dy)
+		std::vector<float> kernel(n);
+		for(int dy = 0; dy < DITHER_SIZE; dy++){
+			for(int dx = 0; dx < DITHER_SIZE; dx++){
+				int wx = std::min(dx, DITHER_SIZE - dx);
+				int wy = std::min(dy, DITHER_SIZE - dy);
+				kernel[dy*DITHER_SIZE + dx] = exp(-(wx*wx + wy*wy)/(2*sigma*sigma));
+			}
+		}
+
+		std::vector<char> pattern(n, 0);
+		std::vector<float> energy(n, 0);
+		auto toggle = [&](int p, float sign){
+			pattern[p] = (sign > 0);
+			int px = p%DITHER_SIZE, py = p/DITHER_SIZE;
+			for(int y = 0; y < DITHER_SIZE; y++){
+				int ky = ((y - py + DITHER_SIZE)%DITHER_SIZE)*DITHER_SIZE;
+				for(int x = 0; x < DITHER_SIZE; x++){
+					energy[y*DITHER_SIZE + x] += sign*kernel[ky + (x - px + DITHER_SIZE)%DITHER_SIZE];
+				}
+			}
+		};
+		// Tightest cluster among ones, or largest void among zeros
+		auto extreme = [&](char value){
+			int best = -1;
+			for(int p = 0; p < n; p++){
+				if(pattern[p] != value)
+					continue;
+				if(best < 0 || (value ? energy[p] > energy[best] : energy[p] < energy[best]))
+					best = p;
+			}
+			return best;
+		};
+
+		// Initial pattern: 10% random points, relaxed until stable
+		std::mt19937 rng(1993);
+		int ones = n/10;
+		for(int placed = 0; placed < ones;){
+			int p = rng()%n;
+			if(!pattern[p]){
+				toggle(p, 1);
+				placed++;
+			}
+		}
+		while(true){
+			int cluster = extreme(1);
+			toggle(cluster, -1);
+			int hole = extreme(0);
+			toggle(hole, 1);
+			if(hole == cluster)
+				break;
+		}
+		std::vector<char> initial = pattern;
+		std::vector<float> initialEnergy = energy;
+
+		// Ranks below the initial pattern: peel off tightest clusters
+		rank.assign(n, 0);
+		for(int r = ones - 1; r >= 0; r--){
+			int cluster = extreme(1);
+			toggle(cluster, -1);
+			rank[cluster] = r;
+		}
+
+		// Ranks above: fill largest voids
+		pattern = initial;
+		energy = initialEnergy;
+		for(int r = ones; r < n; r++){
+			int hole = extreme(0);
+			toggle(hole, 1);
+			rank[hole] = r;
+		}
+	}
+
+public:
+	DitherTable(DitherMode mode){
+		static const int bayer[8][8] = {
+			{ 0, 32,  8, 40,  2, 34, 10, 42},
+			{48, 16, 56, 24, 50, 18, 58, 26},
+			{12, 44,  4, 36, 14, 46,  6, 38},
+			{60, 28, 52, 20, 62, 30, 54, 22},
+			{ 3, 35, 11, 43,  1, 33,  9, 41},
+			{51, 19, 59, 27, 49, 17, 57, 25},
+			{15, 47,  7, 39, 13, 45,  5, 37},
+			{63, 31, 55, 23, 61, 29, 53, 21}
+		};
+
+		std::vector<int> rank;
+		if(mode == DITHER_BLUE_NOISE)
+			blueNoiseRanks(rank);
+
+		for(int y = 0; y < DITHER_SIZE; y++){
+			for(int x = 0; x < DITHER_SIZE; x++){
+				for(int c = 0; c < 4; c++){
+					float threshold = 0;
+					if(mode == DITHER_ORDERED){
+						threshold = (bayer[y%8][x%8] + 0.5f)/64;
+					}else if(mode == DITHER_BLUE_NOISE){
+						// Offset each channel into the mask so channel errors don't line up
+						int sx = (x + 19*c)%DITHER_SIZE;
+						int sy = (y + 37*c)%DITHER_SIZE;
+						threshold = (rank[sy*DITHER_SIZE + sx] + 0.5f)/(DITHER_SIZE*DITHER_SIZE);
+					}
+					_table[(y*DITHER_SIZE + x)*4 + c] = threshold;
+				}
+			}
+		}
+	}
+
+	const float * getRow(int y) const {return &_table[(y%DITHER_SIZE)*DITHER_SIZE*4];}
+
+	static const DitherTable& get(DitherMode mode){
+		// Built on first use, the blue noise mask takes a moment to rank
+		if(mode == DITHER_ORDERED){
+			static DitherTable ordered(DITHER_ORDERED);
+			return ordered;
+		}else if(mode == DITHER_BLUE_NOISE){
+			static DitherTable blue(DITHER_BLUE_NOISE);
+			return blue;
+		}
+		static DitherTable none(DITHER_NONE);
+		return none;
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////QUANTIZE////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Quantizes width pixels of frame row y (y only picks the dither row) into
+// interleaved RGB samples of format.bits each.
+void quantizeRow(const Pixel * row, int width, int y, const OutputFormat& format, void * out){
+	static_assert(sizeof(Pixel) == 4*sizeof(float), "quantizeRow reads pixels as packed RGBA floats");
+
+	const float * lut = (format.transfer == TRANSFER_LINEAR ? nullptr : TransferLUT::get(format.transfer).getTable());
+	const float * dither = DitherTable::get(format.dither).getRow(y);
+	float maxValue = (format.bits == 16 ? 65535.0f : 255.0f);
+	uint8_t * out8 = (uint8_t *)out;
+	uint16_t * out16 = (uint16_t *)out;
+
+	const float8 zero(0.0f), one(1.0f), lutScale((float)TRANSFER_LUT_SIZE), scale(maxValue);
+	float tail[8];
+	int q[8];
+	for(int x = 0; x < width; x += 2){
+		float8 v;
+		if(x + 1 < width){
+			v = float8::load((const float *)&row[x]);
+		}else{
+			memcpy(tail, &row[x], sizeof(Pixel));
+			memcpy(tail + 4, &row[x], sizeof(Pixel));
+			v = float8::load(tail);
+		}
+
+		if(lut){
+			float8 index = min(max(v, zero), one)*lutScale;
+			float8 base = floor(index);
+			float8 lo = gather(lut, base);
+			float8 hi = gather(lut + 1, base);
+			v = lo + (index - base)*(hi - lo);
+		}
+
+		v = v*scale + float8::load(dither + (x%DITHER_SIZE)*4);
+		v = min(max(v, zero), scale);
+		v.storeTruncated(q);
+
+		int pixels = (x + 1 < width ? 2 : 1);
+		for(int p = 0; p < pixels; p++){
+			int o = (x + p)*3;
+			if(format.bits == 16){
+				out16[o + 0] = q[p*4 + 0];
+				out16[o + 1] = q[p*4 + 1];
+				out16[o + 2] = q[p*4 + 2];
+			}else{
+				out8[o + 0] = q[p*4 + 0];
+				out8[o + 1] = q[p*4 + 1];
+				out8[o + 2] = q[p*4 + 2];
+			}
+		}
+	}
+}
+
+// Quantizes height rows starting at frame row y0 into a tightly packed RGB image
+void quantizeRows(const Pixel * pixels, int stride, int width, int height, int y0, const OutputFormat& format, void * out){
+	size_t rowBytes = (size_t)width*3*format.bytesPerSample();
+	parallelFor(0, height, 16, [&](int begin, int end){
+		for(int y = begin; y < end; y++){
+			quantizeRow(pixels + (size_t)y*stride, width, y0 + y, format, (uint8_t *)out + y*rowBytes);
+		}
+	});
+}
+
+#endif // QUANTIZE_H
@@ -0,0 +1,371 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <EIGEN_SETTINGS.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Critical path entries printed before the rest are summed up
+#define CRITICAL_PATH_PRINT 16
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////TASK GRAPH////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Units of work and what each has to wait for. A task runs once everything it
+// depends on has finished; tasks with nothing between them can run at the same
+// time. Lower priority values are more urgent (e.g. the frame number, so
+// earlier frames finish first). After a run every task keeps when and on which
+// thread it ran, so the graph can show where the time went.
+class TaskGraph{
+	typedef std::chrono::steady_clock Clock;
+
+	struct Task{
+		std::string name;
+		int priority;
+		std::function<void()> fn;
+		std::vector<int> successors;
+		int dependencies = 0;
+		std::atomic<int> waiting;
+		int thread = -1;
+		Clock::time_point start, end;
+	};
+
+	std::vector<std::unique_ptr<Task>> _tasks;
+	Clock::time_point _start, _end;
+
+	friend class TaskScheduler;
+
+	double millis(Clock::time_point a, Clock::time_point b){
+		return std::chrono::duration<double, std::milli>(b - a).count();
+	}
+
+public:
+	// Returns the new task's id
+	int add(const std::string& name, int priority, const std::function<void()>& fn){
+		Task * task = new Task();
+		task->name = name;
+		task->priority = priority;
+		task->fn = fn;
+		_tasks.emplace_back(task);
+		return _tasks.size() - 1;
+	}
+
+	// task doesn't start until on has finished. Either can be -1 for no task,
+	// which does nothing.
+	void depend(int task, int on){
+		if(task < 0 || on < 0)
+			return;
+		_tasks[on]->successors.push_back(task);
+		_tasks[task]->dependencies++;
+	}
+
+	int getTaskCount(){return _tasks.size();}
+	const std::string& getName(int task){return _tasks[task]->name;}
+	int getThread(int task){return _tasks[task]->thread;}
+	double getMillis(int task){return millis(_tasks[task]->start, _tasks[task]->end);}
+	double getWallMillis(){return millis(_start, _end);}
+
+	// Tasks in an order where each comes after everything it depends on, or
+	// an empty list if the dependencies go round in a circle
+	std::vector<int> getOrder(){
+		std::vector<int> waiting(_tasks.size()), order;
+		for(int i = 0; i < _tasks.size(); i++){
+			waiting[i] = _tasks[i]->dependencies;
+			if(waiting[i] == 0)
+				order.push_back(i);
+		}
+		for(int i = 0; i < order.size(); i++){
+			for(int successor : _tasks[order[i]]->successors){
+				if(--waiting[successor] == 0)
+					order.push_back(successor);
+			}
+		}
+		if(order.size() != _tasks.size())
+			order.clear();
+		return order;
+	}
+
+	// The chain of dependent tasks that took longest in the last run: nothing
+	// else overlapping, the run couldn't have finished sooner than it
+	std::vector<int> getCriticalPath(){
+		std::vector<int> order = getOrder();
+		std::vector<double> finish(_tasks.size(), 0);
+		std::vector<int> before(_tasks.size(), -1);
+		int last = -1;
+		for(int task : order){
+			finish[task] += getMillis(task);
+			if(last < 0 || finish[task] > finish[last])
+				last = task;
+			for(int successor : _tasks[task]->successors){
+				if(finish[task] > finish[successor]){
+					finish[successor] = finish[task];
+					before[successor] = task;
+				}
+			}
+		}
+
+		std::vector<int> path;
+		for(int task = last; task >= 0; task = before[task]){
+			path.push_back(task);
+		}
+		std::reverse(path.begin(), path.end());
+		return path;
+	}
+
+	void printCriticalPath(){
+		std::vector<int> path = getCriticalPath();
+		double work = 0, critical = 0;
+		for(int i = 0; i < _tasks.size(); i++){
+			work += getMillis(i);
+		}
+		for(int task : path){
+			critical += getMillis(task);
+		}
+		PRINT(_tasks.size() << " tasks in " << getWallMillis() << " ms: " << work << " ms of work, critical path "
+			<< critical << " ms over " << path.size() << " tasks");
+
+		double rest = 0;
+		for(int i = 0; i < path.size(); i++){
+			if(i >= CRITICAL_PATH_PRINT){
+				rest += getMillis(path[i]);
+				continue;
+			}
+			PRINT("  " << getName(path[i]) << ": " << getMillis(path[i]) << " ms on thread " << getThread(path[i]));
+		}
+		if(path.size() > CRITICAL_PATH_PRINT)
+			PRINT("  ... " << path.size() - CRITICAL_PATH_PRINT << " more: " << rest << " ms");
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////SCHEDULER////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Persistent threads that run task graphs, one graph at a time. Each thread
+// (the one that called run() included) keeps its own queue of ready tasks:
+// it takes the newest from the back of its own, so a frame that has started
+// is carried through before new work begins, and when that is empty steals
+// the oldest from the front of another's. Tasks a finished task makes ready
+// go on the finishing thread's queue, most urgent last.
+//
+// Tasks may use parallelFor(); the pool joins in when it's free and the loop
+// runs on the task's thread when it isn't. A graph run from inside a task (or
+// while another graph is running) runs on the calling thread alone.
+class TaskScheduler{
+	struct Queue{
+		std::mutex mutex;
+		std::deque<int> tasks;
+	};
+
+	std::vector<std::thread> _threads;
+	std::vector<std::unique_ptr<Queue>> _queues; // [0] is the thread that called run()
+	std::mutex _mutex, _run_mutex;
+	std::condition_variable _wake, _done;
+	TaskGraph * _graph;
+	std::atomic<int> _ready, _remaining;
+	unsigned _generation;
+	int _active;
+	bool _quit;
+
+	static int& threadIndex(){
+		static thread_local int index = -1;
+		return index;
+	}
+
+	// Most urgent last, so it's the next one taken
+	void push(int queue, std::vector<int>& tasks){
+		if(tasks.empty())
+			return;
+		std::sort(tasks.begin(), tasks.end(), [&](int a, int b){
+			return _graph->_tasks[a]->priority > _graph->_tasks[b]->priority;
+		});
+		{
+			std::lock_guard<std::mutex> lock(_queues[queue]->mutex);
+			for(int task : tasks){
+				_queues[queue]->tasks.push_back(task);
+			}
+		}
+		_ready += tasks.size();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(tasks.size() > 1)
+			_wake.notify_all();
+		else
+			_wake.notify_one();
+	}
+
+	int take(int queue){
+		{
+			Queue& own = *_queues[queue];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if(!own.tasks.empty()){
+				int task = own.tasks.back();
+				own.tasks.pop_back();
+				_ready--;
+				return task;
+			}
+		}
+		for(int i = 1; i < _queues.size(); i++){
+			Queue& victim = *_queues[(queue + i)%_queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if(!victim.tasks.empty()){
+				int task = victim.tasks.front();
+				victim.tasks.pop_front();
+				_ready--;
+				return task;
+			}
+		}
+		return -1;
+	}
+
+	void execute(int queue, int id){
+		TaskGraph::Task& task = *_graph->_tasks[id];
+		task.thread = queue;
+		task.start = TaskGraph::Clock::now();
+		task.fn();
+		task.end = TaskGraph::Clock::now();
+
+		std::vector<int> ready;
+		for(int successor : task.successors){
+			if(--_graph->_tasks[successor]->waiting == 0)
+				ready.push_back(successor);
+		}
+		push(queue, ready);
+
+		if(--_remaining == 0){
+			std::lock_guard<std::mutex> lock(_mutex);
+			_wake.notify_all();
+		}
+	}
+
+	// Runs tasks until the graph is done
+	void work(int queue){
+		while(_remaining > 0){
+			int task = take(queue);
+			if(task >= 0){
+				execute(queue, task);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait(lock, [&]{return _ready > 0 || _remaining == 0;});
+		}
+	}
+
+	void threadLoop(int queue){
+		threadIndex() = queue;
+		unsigned seen = 0;
+		while(true){
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wake.wait(lock, [&]{return _quit || _generation != seen;});
+				if(_quit)
+					return;
+				seen = _generation;
+			}
+
+			work(queue);
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			if(--_active == 0)
+				_done.notify_one();
+		}
+	}
+
+	// Every task on the calling thread, in dependency order
+	void runInline(TaskGraph& graph){
+		for(int task : graph.getOrder()){
+			graph._tasks[task]->thread = threadIndex();
+			graph._tasks[task]->start = TaskGraph::Clock::now();
+			graph._tasks[task]->fn();
+			graph._tasks[task]->end = TaskGraph::Clock::now();
+		}
+	}
+
+public:
+	TaskScheduler(int threads = 0): _graph(nullptr), _ready(0), _remaining(0), _generation(0), _active(0), _quit(false){
+		if(threads <= 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		for(int i = 0; i < threads; i++){
+			_queues.emplace_back(new Queue());
+		}
+		for(int i = 1; i < threads; i++){
+			_threads.push_back(std::thread(&TaskScheduler::threadLoop, this, i));
+		}
+	}
+
+	~TaskScheduler(){
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_wake.notify_all();
+		for(int i = 0; i < _threads.size(); i++){
+			_threads[i].join();
+		}
+	}
+
+	int getThreadCount(){return _queues.size();}
+
+	// Runs every task of graph, returning once they have all finished
+	void run(TaskGraph& graph){
+		if(graph.getOrder().empty() && graph.getTaskCount() > 0){
+			ERROR("ERROR - SCHEDULER - Task dependencies go round in a circle ...bailing");
+			exit(0);
+		}
+
+		graph._start = TaskGraph::Clock::now();
+		// A thread already inside a run (a task, or the caller of that run) must
+		// not try the lock it may hold itself
+		std::unique_lock<std::mutex> running(_run_mutex, std::defer_lock);
+		if(threadIndex() >= 0 || !running.try_lock()){
+			runInline(graph);
+			graph._end = TaskGraph::Clock::now();
+			return;
+		}
+
+		_graph = &graph;
+		_remaining = graph.getTaskCount();
+		std::vector<int> roots;
+		for(int i = 0; i < graph.getTaskCount(); i++){
+			graph._tasks[i]->waiting = graph._tasks[i]->dependencies;
+			if(graph._tasks[i]->dependencies == 0)
+				roots.push_back(i);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_active = _threads.size();
+			_generation++;
+		}
+		_wake.notify_all();
+		threadIndex() = 0;
+		push(0, roots);
+		work(0);
+		threadIndex() = -1;
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_done.wait(lock, [&]{return _active == 0;});
+		}
+		_graph = nullptr;
+		graph._end = TaskGraph::Clock::now();
+	}
+};
+
+TaskScheduler& taskScheduler(){
+	static TaskScheduler scheduler;
+	return scheduler;
+}
+
+#endif // SCHEDULER_H
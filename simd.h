@@ -0,0 +1,222 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+#include <string.h>
+#include <cmath>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// 8 float lanes. Comparisons return lane masks (all bits set where true) that
+// can be combined with & | and reduced with movemask(). Without AVX this falls
+// back to plain arrays, which the compiler is still free to vectorize.
+
+#ifdef __AVX__
+
+struct float8{
+	__m256 v;
+
+	float8(){}
+	float8(__m256 v_in): v(v_in){}
+	float8(float f): v(_mm256_set1_ps(f)){}
+
+	static float8 load(const float * p){return _mm256_loadu_ps(p);}
+	void store(float * p) const{_mm256_storeu_ps(p, v);}
+
+	// 0, 1, ..., 7
+	static float8 ramp(){return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);}
+
+	// Truncates towards zero, like a (int) cast
+	void storeTruncated(int * p) const{_mm256_storeu_si256((__m256i *)p, _mm256_cvttps_epi32(v));}
+};
+
+inline float8 operator+(const float8& a, const float8& b){return _mm256_add_ps(a.v, b.v);}
+inline float8 operator-(const float8& a, const float8& b){return _mm256_sub_ps(a.v, b.v);}
+inline float8 operator*(const float8& a, const float8& b){return _mm256_mul_ps(a.v, b.v);}
+inline float8 operator/(const float8& a, const float8& b){return _mm256_div_ps(a.v, b.v);}
+inline float8 operator&(const float8& a, const float8& b){return _mm256_and_ps(a.v, b.v);}
+inline float8 operator|(const float8& a, const float8& b){return _mm256_or_ps(a.v, b.v);}
+inline float8 operator>=(const float8& a, const float8& b){return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ);}
+inline float8 operator>(const float8& a, const float8& b){return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ);}
+inline float8 operator<=(const float8& a, const float8& b){return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ);}
+inline float8 operator<(const float8& a, const float8& b){return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ);}
+inline float8 min(const float8& a, const float8& b){return _mm256_min_ps(a.v, b.v);}
+inline float8 max(const float8& a, const float8& b){return _mm256_max_ps(a.v, b.v);}
+inline float8 floor(const float8& a){return _mm256_floor_ps(a.v);}
+inline float8 sqrt(const float8& a){return _mm256_sqrt_ps(a.v);}
+inline float8 abs(const float8& a){return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v);}
+// mask ? a : b
+inline float8 select(const float8& mask, const float8& a, const float8& b){return _mm256_blendv_ps(b.v, a.v, mask.v);}
+inline int movemask(const float8& mask){return _mm256_movemask_ps(mask.v);}
+// table[(int)index] per lane
+inline float8 gather(const float * table, const float8& index){
+#ifdef __AVX2__
+	return _mm256_i32gather_ps(table, _mm256_cvttps_epi32(index.v), 4);
+#else
+	int i[8];
+	index.storeTruncated(i);
+	return _mm256_setr_ps(table[i[0]], table[i[1]], table[i[2]], table[i[3]], table[i[4]], table[i[5]], table[i[6]], table[i[7]]);
+#endif
+}
+
+#else
+
+struct float8{
+	float v[8];
+
+	float8(){}
+	float8(float f){for(int i = 0; i < 8; i++) v[i] = f;}
+
+	static float8 load(const float * p){float8 r; for(int i = 0; i < 8; i++) r.v[i] = p[i]; return r;}
+	void store(float * p) const{for(int i = 0; i < 8; i++) p[i] = v[i];}
+
+	static float8 ramp(){float8 r; for(int i = 0; i < 8; i++) r.v[i] = i; return r;}
+
+	void storeTruncated(int * p) const{for(int i = 0; i < 8; i++) p[i] = (int)v[i];}
+};
+
+#define SIMD_FALLBACK_OP(op) \
+	inline float8 operator op(const float8& a, const float8& b){float8 r; for(int i = 0; i < 8; i++) r.v[i] = a.v[i] op b.v[i]; return r;}
+#define SIMD_FALLBACK_CMP(op) \
+	inline float8 operator op(const float8& a, const float8& b){ \
+		float8 r; \
+		for(int i = 0; i < 8; i++){uint32_t m = (a.v[i] op b.v[i]) ? 0xFFFFFFFFu : 0; memcpy(&r.v[i], &m, 4);} \
+		return r; \
+	}
+#define SIMD_FALLBACK_BIT(op) \
+	inline float8 operator op(const float8& a, const float8& b){ \
+		float8 r; \
+		for(int i = 0; i < 8; i++){ \
+			uint32_t x, y; memcpy(&x, &a.v[i], 4); memcpy(&y, &b.v[i], 4); \
+			x = x op y; memcpy(&r.v[i], &x, 4); \
+		} \
+		return r; \
+	}
+
+SIMD_FALLBACK_OP(+)
+SIMD_FALLBACK_OP(-)
+SIMD_FALLBACK_OP(*)
+SIMD_FALLBACK_OP(/)
+SIMD_FALLBACK_CMP(>=)
+SIMD_FALLBACK_CMP(>)
+SIMD_FALLBACK_CMP(<=)
+SIMD_FALLBACK_CMP(<)
+SIMD_FALLBACK_BIT(&)
+SIMD_FALLBACK_BIT(|)
+
+#undef SIMD_FALLBACK_OP
+#undef SIMD_FALLBACK_CMP
+#undef SIMD_FALLBACK_BIT
+
+inline float8 min(const float8& a, const float8& b){float8 r; for(int i = 0; i < 8; i++) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r;}
+inline float8 max(const float8& a, const float8& b){float8 r; for(int i = 0; i < 8; i++) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r;}
+inline float8 floor(const float8& a){float8 r; for(int i = 0; i < 8; i++) r.v[i] = std::floor(a.v[i]); return r;}
+inline float8 sqrt(const float8& a){float8 r; for(int i = 0; i < 8; i++) r.v[i] = std::sqrt(a.v[i]); return r;}
+inline float8 abs(const float8& a){float8 r; for(int i = 0; i < 8; i++) r.v[i] = std::fabs(a.v[i]); return r;}
+inline int movemask(const float8& mask){
+	int bits = 0;
+	for(int i = 0; i < 8; i++){
+		uint32_t m;
+		memcpy(&m, &mask.v[i], 4);
+		bits |= (m >> 31) << i;
+	}
+	return bits;
+}
+inline float8 select(const float8& mask, const float8& a, const float8& b){
+	float8 r;
+	for(int i = 0; i < 8; i++) r.v[i] = (movemask(mask) >> i) & 1 ? a.v[i] : b.v[i];
+	return r;
+}
+inline float8 gather(const float * table, const float8& index){float8 r; for(int i = 0; i < 8; i++) r.v[i] = table[(int)index.v[i]]; return r;}
+
+#endif // __AVX__
+
+// 4 float lanes, used for one RGBA pixel at a time
+
+#ifdef __SSE__
+
+struct float4{
+	__m128 v;
+
+	float4(){}
+	float4(__m128 v_in): v(v_in){}
+	float4(float f): v(_mm_set1_ps(f)){}
+
+	static float4 load(const float * p){return _mm_loadu_ps(p);}
+	void store(float * p) const{_mm_storeu_ps(p, v);}
+
+	// Lane 3 (alpha) in every lane
+	float4 splatW() const{return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));}
+};
+
+inline float4 operator+(const float4& a, const float4& b){return _mm_add_ps(a.v, b.v);}
+inline float4 operator-(const float4& a, const float4& b){return _mm_sub_ps(a.v, b.v);}
+inline float4 operator*(const float4& a, const float4& b){return _mm_mul_ps(a.v, b.v);}
+inline float4 min(const float4& a, const float4& b){return _mm_min_ps(a.v, b.v);}
+inline float4 max(const float4& a, const float4& b){return _mm_max_ps(a.v, b.v);}
+
+#else
+
+struct float4{
+	float v[4];
+
+	float4(){}
+	float4(float f){for(int i = 0; i < 4; i++) v[i] = f;}
+
+	static float4 load(const float * p){float4 r; for(int i = 0; i < 4; i++) r.v[i] = p[i]; return r;}
+	void store(float * p) const{for(int i = 0; i < 4; i++) p[i] = v[i];}
+
+	float4 splatW() const{return float4(v[3]);}
+};
+
+inline float4 operator+(const float4& a, const float4& b){float4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] + b.v[i]; return r;}
+inline float4 operator-(const float4& a, const float4& b){float4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] - b.v[i]; return r;}
+inline float4 operator*(const float4& a, const float4& b){float4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] * b.v[i]; return r;}
+inline float4 min(const float4& a, const float4& b){float4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r;}
+inline float4 max(const float4& a, const float4& b){float4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r;}
+
+#endif // __SSE__
+
+// 4 double lanes, for running sums over float4 pixels where the order of
+// accumulation must not show up in the result
+
+#ifdef __AVX__
+
+struct double4{
+	__m256d v;
+
+	double4(){}
+	double4(__m256d v_in): v(v_in){}
+	double4(double d): v(_mm256_set1_pd(d)){}
+	double4(const float4& f): v(_mm256_cvtps_pd(f.v)){}
+
+	float4 toFloat4() const{return _mm256_cvtpd_ps(v);}
+};
+
+inline double4 operator+(const double4& a, const double4& b){return _mm256_add_pd(a.v, b.v);}
+inline double4 operator-(const double4& a, const double4& b){return _mm256_sub_pd(a.v, b.v);}
+inline double4 operator*(const double4& a, const double4& b){return _mm256_mul_pd(a.v, b.v);}
+
+#else
+
+struct double4{
+	double v[4];
+
+	double4(){}
+	double4(double d){for(int i = 0; i < 4; i++) v[i] = d;}
+	double4(const float4& f){float t[4]; f.store(t); for(int i = 0; i < 4; i++) v[i] = t[i];}
+
+	float4 toFloat4() const{float t[4]; for(int i = 0; i < 4; i++) t[i] = v[i]; return float4::load(t);}
+};
+
+inline double4 operator+(const double4& a, const double4& b){double4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] + b.v[i]; return r;}
+inline double4 operator-(const double4& a, const double4& b){double4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] - b.v[i]; return r;}
+inline double4 operator*(const double4& a, const double4& b){double4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] * b.v[i]; return r;}
+
+#endif // __AVX__
+
+#endif // SIMD_H
@@ -0,0 +1,343 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <EIGEN_SETTINGS.h>
+#include <math.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "layer.h"
+#include "keyframe.h"
+#include "memory.h"
+#include "simd.h"
+#include "parallel.h"
+#include "font8x8.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////GLYPH ATLAS////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define ATLAS_COLUMNS 16
+#define ATLAS_GLYPHS (FONT8X8_LAST - FONT8X8_FIRST + 1)
+
+// Coverage of every glyph of the built in 8x8 font at one pixel size, each in
+// its own cell with a clear border pixel so it can be sampled between pixels.
+// A glyph is rasterized the first time a string needs it and kept for as long
+// as the program runs; every Text layer at that size shares the atlas.
+class GlyphAtlas{
+	int _size, _cell;
+	std::vector<float, TrackedAllocator<float, MEM_TEXTURES>> _coverage;
+	std::vector<uint8_t> _ready;
+	std::mutex _mutex;
+
+	GlyphAtlas(int size): _size(size), _cell(size + 2){
+		int rows = (ATLAS_GLYPHS + ATLAS_COLUMNS - 1)/ATLAS_COLUMNS;
+		_coverage.assign((size_t)ATLAS_COLUMNS*_cell*rows*_cell, 0);
+		_ready.assign(ATLAS_GLYPHS, 0);
+	}
+
+	// Box filters the font bitmap down (or up) to _size pixels
+	void rasterize(int glyph){
+		const uint8_t * bits = FONT8X8[glyph];
+		float step = 8.0f/_size;
+
+		// overlap[i*8 + b]: how much of output pixel i font pixel b covers
+		std::vector<float> overlap(_size*8, 0);
+		for(int i = 0; i < _size; i++){
+			for(int b = 0; b < 8; b++){
+				float lo = std::max(i*step, (float)b), hi = std::min((i + 1)*step, (float)(b + 1));
+				overlap[i*8 + b] = std::max(0.0f, hi - lo)/step;
+			}
+		}
+
+		float * cell = cellOf(glyph);
+		for(int j = 0; j < _size; j++){
+			for(int i = 0; i < _size; i++){
+				float sum = 0;
+				for(int a = 0; a < 8; a++){
+					if(overlap[j*8 + a] == 0)
+						continue;
+					float across = 0;
+					for(int b = 0; b < 8; b++){
+						if(bits[a] & (1 << b))
+							across += overlap[i*8 + b];
+					}
+					sum += across*overlap[j*8 + a];
+				}
+				cell[(j + 1)*getStride() + i + 1] = std::min(sum, 1.0f);
+			}
+		}
+	}
+
+	float * cellOf(int glyph){
+		return &_coverage[(size_t)(glyph/ATLAS_COLUMNS)*_cell*getStride() + (glyph%ATLAS_COLUMNS)*_cell];
+	}
+
+public:
+	// Shared atlas for size pixel glyphs
+	static GlyphAtlas& get(int size){
+		static std::mutex mutex;
+		static std::map<int, std::unique_ptr<GlyphAtlas>> atlases;
+		std::lock_guard<std::mutex> lock(mutex);
+		std::unique_ptr<GlyphAtlas>& atlas = atlases[size];
+		if(!atlas)
+			atlas.reset(new GlyphAtlas(size));
+		return *atlas;
+	}
+
+	int getSize(){return _size;}
+	int getCellSize(){return _cell;}
+	int getStride(){return ATLAS_COLUMNS*_cell;}
+
+	static bool hasGlyph(char c){
+		return c >= FONT8X8_FIRST && c <= FONT8X8_LAST;
+	}
+
+	// Rasterizes the glyph for c if it hasn't been yet
+	void prepare(char c){
+		if(!hasGlyph(c))
+			return;
+		std::lock_guard<std::mutex> lock(_mutex);
+		int glyph = c - FONT8X8_FIRST;
+		if(!_ready[glyph]){
+			rasterize(glyph);
+			_ready[glyph] = 1;
+		}
+	}
+
+	// Cell for c, getCellSize() square with rows getStride() apart. Pixel
+	// (x, y) of the glyph is at (x + 1, y + 1). c must have been prepared.
+	const float * getCell(char c){
+		return cellOf(c - FONT8X8_FIRST);
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////TEXT///////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A string of the built in font. Layer pixel (0, 0) is the top left of the
+// first line; '\n' starts a new line. Use the layer transform to place it,
+// and the anchor to leave room for characters animated up or left of (0, 0),
+// since layer pixels outside the frame's size are never rendered.
+//
+// Glyphs come out of the shared atlas for the size, so animating characters
+// (position and opacity) costs a blend per glyph pixel and never rasterizes
+// anything again. Positions don't have to be whole pixels; glyphs are
+// filtered between atlas pixels.
+class Text : public Layer{
+	struct Glyph{
+		char c;
+		int index; // Into the string
+		float x, y;
+	};
+
+	struct CharacterAnimators{
+		Float_Animator * x = nullptr;
+		Float_Animator * y = nullptr;
+		Float_Animator * opacity = nullptr;
+	};
+
+	// A glyph as drawn this frame
+	struct Placed{
+		const float * cell;
+		int x, y;       // Destination of cell pixel (0, 0)
+		float fx, fy;   // Sub-pixel offset
+		float colour[4]; // Premultiplied by the glyph's opacity
+	};
+
+	std::string _text;
+	GlyphAtlas * _atlas;
+	VEC3 _colour;
+	float _tracking, _leading;
+	std::vector<Glyph> _glyphs;
+
+	// Not owned, same as the layer transform animators
+	std::map<int, CharacterAnimators> _characters;
+	CharacterAnimators _stagger;
+	float _stagger_delay = 0;
+
+	void layout(){
+		_glyphs.clear();
+		float advance = _atlas->getSize() + _tracking, line = _atlas->getSize() + _leading;
+		float x = 0, y = 0;
+		for(int i = 0; i < _text.size(); i++){
+			char c = _text[i];
+			if(c == '\n'){
+				x = 0;
+				y += line;
+				continue;
+			}
+			if(!GlyphAtlas::hasGlyph(c)){
+				ERROR("ERROR - TEXT - No glyph for character " << (int)(unsigned char)c << ", leaving a gap");
+			}else if(c != ' '){
+				_atlas->prepare(c);
+				Glyph glyph;
+				glyph.c = c;
+				glyph.index = i;
+				glyph.x = x;
+				glyph.y = y;
+				_glyphs.push_back(glyph);
+			}
+			x += advance;
+		}
+	}
+
+	static float sample(Float_Animator * animator, float frame_num, float default_value){
+		return (animator ? animator->interpolate(frame_num) : default_value);
+	}
+
+public:
+	// size is the glyph height in pixels, colour is 0 to 1
+	Text(const std::string& text, int size, const VEC3& colour = VEC3(1, 1, 1)):
+		_text(text), _colour(colour), _tracking(0), _leading(0){
+		if(size < 1){
+			ERROR("ERROR - TEXT - Size must be at least 1 pixel ...bailing");
+			exit(0);
+		}
+		_atlas = &GlyphAtlas::get(size);
+		layout();
+	}
+
+	void setText(const std::string& text){
+		_text = text;
+		layout();
+	}
+	const std::string& getText(){return _text;}
+
+	void setColour(const VEC3& colour){_colour = colour;}
+
+	// Extra space between characters and between lines, in pixels
+	void setTracking(float tracking){
+		_tracking = tracking;
+		layout();
+	}
+	void setLeading(float leading){
+		_leading = leading;
+		layout();
+	}
+
+	// Offset and opacity of the character at index in the string, on top of
+	// any stagger. Any of them can be nullptr. Not owned.
+	void animateCharacter(int index, Float_Animator * offset_x, Float_Animator * offset_y, Float_Animator * opacity){
+		CharacterAnimators& animators = _characters[index];
+		animators.x = offset_x;
+		animators.y = offset_y;
+		animators.opacity = opacity;
+	}
+
+	// The same offset and opacity for every character, each one delay frames
+	// behind the one before, e.g. for letters dropping in one by one. Not owned.
+	void setStagger(Float_Animator * offset_x, Float_Animator * offset_y, Float_Animator * opacity, float delay){
+		_stagger.x = offset_x;
+		_stagger.y = offset_y;
+		_stagger.opacity = opacity;
+		_stagger_delay = delay;
+	}
+
+	float getContentMotion(float t0, float t1){
+		auto change = [&](Float_Animator * animator, float delay){
+			return (animator ? animator->getChange(t0 - delay, t1 - delay) : 0);
+		};
+		float motion = 0;
+		for(int i = 0; i < _glyphs.size(); i++){
+			int index = _glyphs[i].index;
+			float glyph = change(_stagger.x, index*_stagger_delay) + change(_stagger.y, index*_stagger_delay);
+			auto animators = _characters.find(index);
+			if(animators != _characters.end())
+				glyph += change(animators->second.x, 0) + change(animators->second.y, 0);
+			motion = std::max(motion, glyph);
+		}
+		return motion;
+	}
+
+	bool tracksWrites(){return true;}
+
+	void render(const ImageView& target, float frame_num, const TileMask * coverage = nullptr){
+		int cell = _atlas->getCellSize(), stride = _atlas->getStride();
+
+		// Animators are evaluated once per glyph, before any pixels
+		std::vector<Placed> placed;
+		for(int i = 0; i < _glyphs.size(); i++){
+			const Glyph& glyph = _glyphs[i];
+			float x = glyph.x, y = glyph.y, opacity = 1;
+
+			float t = frame_num - glyph.index*_stagger_delay;
+			x += sample(_stagger.x, t, 0);
+			y += sample(_stagger.y, t, 0);
+			opacity *= sample(_stagger.opacity, t, 1);
+
+			auto animators = _characters.find(glyph.index);
+			if(animators != _characters.end()){
+				x += sample(animators->second.x, frame_num, 0);
+				y += sample(animators->second.y, frame_num, 0);
+				opacity *= sample(animators->second.opacity, frame_num, 1);
+			}
+			opacity = std::min(opacity, 1.0f);
+			if(opacity <= 0)
+				continue;
+
+			// Cell pixel (1, 1) holds glyph pixel (0, 0), which lands on (x, y)
+			Placed p;
+			p.cell = _atlas->getCell(glyph.c);
+			p.x = (int)floorf(x) - 1;
+			p.y = (int)floorf(y) - 1;
+			p.fx = x - floorf(x);
+			p.fy = y - floorf(y);
+			for(int c = 0; c < 3; c++){
+				p.colour[c] = _colour[c]*opacity;
+			}
+			p.colour[3] = opacity;
+
+			// The filtered glyph reaches one pixel past the cell's top left
+			int x0 = p.x + 1, y0 = p.y + 1, x1 = x0 + cell - 1, y1 = y0 + cell - 1;
+			x0 = std::max(x0, target.getX0()); x1 = std::min(x1, target.getX1());
+			y0 = std::max(y0, target.getY0()); y1 = std::min(y1, target.getY1());
+			if(x1 <= x0 || y1 <= y0)
+				continue;
+			if(coverage && !coverage->any(x0, y0, x1, y1))
+				continue;
+			placed.push_back(p);
+			target.markWritten(x0, y0, x1, y1);
+		}
+		if(placed.empty())
+			return;
+
+		// Destination (x, y) blends cell pixels (u, v) and (u + 1, v + 1) where
+		// u = x - p.x - 1, weighted by the sub-pixel offset
+		auto blendSpan = [&](const Placed& p, int y, int x0, int x1){
+			int v = y - p.y - 1;
+			const float * r0 = p.cell + v*stride;
+			const float * r1 = r0 + stride;
+			float w00 = p.fx*p.fy, w10 = (1 - p.fx)*p.fy, w01 = p.fx*(1 - p.fy), w11 = (1 - p.fx)*(1 - p.fy);
+			float4 colour = float4::load(p.colour);
+			Pixel * row = target.row(y) - target.getX0();
+			for(int x = x0; x < x1; x++){
+				int u = x - p.x - 1;
+				float alpha = r0[u]*w00 + r0[u + 1]*w10 + r1[u]*w01 + r1[u + 1]*w11;
+				if(alpha <= 0)
+					continue;
+				float4 src = colour*float4(alpha);
+				row[x].set(src + row[x].toFloat4()*(float4(1.0f) - src.splatW()));
+			}
+		};
+
+		// Split by rows so glyphs that overlap still blend in string order
+		parallelFor(target.getY0(), target.getY1(), 16, [&](int begin, int end){
+			for(int i = 0; i < placed.size(); i++){
+				const Placed& p = placed[i];
+				int x0 = std::max(p.x + 1, target.getX0()), x1 = std::min(p.x + cell, target.getX1());
+				int y0 = std::max(p.y + 1, begin), y1 = std::min(p.y + cell, end);
+				for(int y = y0; y < y1; y++){
+					if(coverage)
+						coverage->forEachRun(y, x0, x1, [&](int run0, int run1){blendSpan(p, y, run0, run1);});
+					else
+						blendSpan(p, y, x0, x1);
+				}
+			}
+		});
+	}
+};
+
+#endif // TEXT_H
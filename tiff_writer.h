@@ -0,0 +1,439 @@
+#ifndef TIFF_WRITER_H
+#define TIFF_WRITER_H
+
+#include <EIGEN_SETTINGS.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "quantize.h"
+#include "compress.h"
+#include "parallel.h"
+
+// Rows per strip aimed for when the caller doesn't care: big enough for the
+// codecs to find repeats, small enough for a frame to split over the threads
+#define STRIP_TARGET_BYTES (64*1024)
+// Largest LZ4 block (the frame header says 4 MB)
+#define LZ4_BLOCK_BYTES (4*1024*1024)
+
+// Makes to the same file as from: a hardlink where the filesystem allows it,
+// otherwise a copy. Whatever was at to is replaced, not written through.
+bool linkOrCopyFile(const std::string& from, const std::string& to){
+	unlink(to.c_str());
+	if(link(from.c_str(), to.c_str()) == 0)
+		return true;
+
+	FILE * in = fopen(from.c_str(), "rb");
+	FILE * out = (in ? fopen(to.c_str(), "wb") : nullptr);
+	bool ok = (in && out);
+	std::vector<char> chunk(1 << 16);
+	while(ok){
+		size_t n = fread(chunk.data(), 1, chunk.size(), in);
+		if(n == 0)
+			break;
+		ok = (fwrite(chunk.data(), 1, n, out) == n);
+	}
+	if(in)
+		fclose(in);
+	if(out)
+		fclose(out);
+	if(!ok)
+		ERROR("ERROR - TIFF_WRITER - Could not link or copy " << from << " to " << to);
+	return ok;
+}
+
+// Frame file written one strip (a run of rows) at a time, so a frame never
+// has to be held in memory as a whole. Strips go out as soon as they are
+// handed over, one after another straight after the file's header;
+// subclasses say how the file starts and ends and how strips are compressed.
+class StripWriter{
+protected:
+	FILE * _file;
+	std::string _filename;
+	int _width, _height, _bits, _rowsPerStrip;
+	Compression _compression;
+	int _rowsWritten;
+	bool _failed; // A strip couldn't be compressed, nothing more goes in
+	// Per piece stored: a strip is one piece, or one per colour plane for
+	// writers that keep planes apart (see getPiecesPerStrip())
+	std::vector<uint32_t> _stripOffsets, _stripByteCounts;
+
+	void write16(uint16_t v){fwrite(&v, 2, 1, _file);}
+	void write32(uint32_t v){fwrite(&v, 4, 1, _file);}
+
+	virtual void writeHeader() = 0;
+	virtual void writeTrailer() = 0;
+
+	// Compresses rows rows of packed RGB into out as they go in the file, one
+	// piece after another, adding the size of each to pieces. Returns false if
+	// that failed. Not used without compression, strips then go in as they are.
+	virtual bool encode(const uint8_t * data, int rows, std::vector<uint8_t>& out, std::vector<uint32_t>& pieces) = 0;
+
+	bool checkStrip(int rows){
+		if(_failed)
+			return false;
+		if(rows <= 0 || _rowsWritten + rows > _height || (rows != _rowsPerStrip && _rowsWritten + rows != _height)){
+			ERROR("ERROR - STRIP_WRITER - Bad strip of " << rows << " rows at row " << _rowsWritten << " of " << _filename);
+			return false;
+		}
+		return true;
+	}
+
+	// The strips so far stay, but the file won't be complete
+	void fail(){
+		ERROR("ERROR - STRIP_WRITER - Could not compress a strip of " << _filename);
+		_failed = true;
+	}
+
+	void append(const void * bytes, const std::vector<uint32_t>& pieces, int rows){
+		size_t n = 0;
+		for(uint32_t piece : pieces){
+			_stripOffsets.push_back(ftell(_file) + n);
+			_stripByteCounts.push_back(piece);
+			n += piece;
+		}
+		fwrite(bytes, 1, n, _file);
+		_rowsWritten += rows;
+	}
+
+	void append(const void * bytes, size_t n, int rows){
+		append(bytes, std::vector<uint32_t>(1, n), rows);
+	}
+
+public:
+	StripWriter(): _file(nullptr), _width(0), _height(0), _bits(8), _rowsPerStrip(0), _compression(COMPRESS_NONE), _rowsWritten(0), _failed(false){}
+	virtual ~StripWriter(){}
+
+	bool open(const std::string& filename, int width, int height, int bits, int rowsPerStrip, Compression compression = COMPRESS_NONE){
+		_file = fopen(filename.c_str(), "wb");
+		if(!_file){
+			ERROR("ERROR - STRIP_WRITER - Could not open " << filename << " for writing");
+			return false;
+		}
+
+		_filename = filename;
+		_width = width;
+		_height = height;
+		_bits = bits;
+		_rowsPerStrip = rowsPerStrip;
+		_compression = compression;
+		_rowsWritten = 0;
+		_failed = false;
+		_stripOffsets.clear();
+		_stripByteCounts.clear();
+		writeHeader();
+		return true;
+	}
+
+	int getRowBytes(){return _width*3*(_bits/8);}
+
+	// Bytes before the first strip
+	virtual int getHeaderBytes() = 0;
+
+	// Pieces each strip is stored as
+	virtual int getPiecesPerStrip(){return 1;}
+
+	// Sizes of the pieces written so far, as stored
+	const std::vector<uint32_t>& getStripByteCounts(){return _stripByteCounts;}
+
+	// Appends the next strip: rowsPerStrip rows (fewer for the last one) of packed RGB
+	void writeStrip(const void * data, int rows){
+		if(!checkStrip(rows))
+			return;
+		if(_compression == COMPRESS_NONE){
+			append(data, (size_t)rows*getRowBytes(), rows);
+			return;
+		}
+		std::vector<uint8_t> encoded;
+		std::vector<uint32_t> pieces;
+		if(!encode((const uint8_t *)data, rows, encoded, pieces)){
+			fail();
+			return;
+		}
+		append(encoded.data(), pieces, rows);
+	}
+
+	// Appends the next rows rows as whole strips, compressing them in parallel
+	void writeStrips(const void * data, int rows){
+		int strips = (rows + _rowsPerStrip - 1)/_rowsPerStrip;
+		size_t stripBytes = (size_t)_rowsPerStrip*getRowBytes();
+		auto stripRows = [&](int s){return std::min(_rowsPerStrip, rows - s*_rowsPerStrip);};
+
+		if(_compression == COMPRESS_NONE){
+			for(int s = 0; s < strips; s++){
+				if(!checkStrip(stripRows(s)))
+					return;
+				append((const uint8_t *)data + s*stripBytes, (size_t)stripRows(s)*getRowBytes(), stripRows(s));
+			}
+			return;
+		}
+
+		std::vector<std::vector<uint8_t>> encoded(strips);
+		std::vector<std::vector<uint32_t>> pieces(strips);
+		std::vector<uint8_t> isEncoded(strips);
+		parallelFor(0, strips, 1, [&](int begin, int end){
+			for(int s = begin; s < end; s++){
+				isEncoded[s] = encode((const uint8_t *)data + s*stripBytes, stripRows(s), encoded[s], pieces[s]);
+			}
+		});
+
+		for(int s = 0; s < strips; s++){
+			if(!checkStrip(stripRows(s)))
+				return;
+			if(!isEncoded[s]){
+				fail();
+				return;
+			}
+			append(encoded[s].data(), pieces[s], stripRows(s));
+		}
+	}
+
+	// Appends the first strips strips of from, as stored, given the sizes of
+	// its pieces. from must have been written the same way: size, format,
+	// compression and strip height.
+	bool copyStrips(const std::string& from, const std::vector<uint32_t>& byteCounts, int strips){
+		int perStrip = getPiecesPerStrip();
+		FILE * in = fopen(from.c_str(), "rb");
+		if(!in || strips*perStrip > byteCounts.size() || fseek(in, getHeaderBytes(), SEEK_SET) != 0){
+			ERROR("ERROR - STRIP_WRITER - Could not read strips from " << from);
+			if(in)
+				fclose(in);
+			return false;
+		}
+
+		std::vector<uint8_t> data;
+		bool ok = true;
+		for(int i = 0; i < strips && ok; i++){
+			std::vector<uint32_t> pieces(byteCounts.begin() + i*perStrip, byteCounts.begin() + (i + 1)*perStrip);
+			size_t n = 0;
+			for(uint32_t piece : pieces){
+				n += piece;
+			}
+			data.resize(n);
+			ok = (fread(data.data(), 1, data.size(), in) == data.size()) && checkStrip(_rowsPerStrip);
+			if(ok)
+				append(data.data(), pieces, _rowsPerStrip);
+		}
+		fclose(in);
+		if(!ok)
+			ERROR("ERROR - STRIP_WRITER - " << from << " is shorter than " << strips << " strips");
+		return ok;
+	}
+
+	bool close(){
+		if(!_file)
+			return false;
+
+		bool complete = (_rowsWritten == _height);
+		if(!complete)
+			ERROR("ERROR - STRIP_WRITER - Only " << _rowsWritten << " of " << _height << " rows written to " << _filename);
+
+		writeTrailer();
+		fclose(_file);
+		_file = nullptr;
+		return complete;
+	}
+};
+
+// Baseline RGB TIFF. The directory (strip offsets and sizes) is appended on
+// close and the header is patched to point at it. Strips are stored as they
+// are, with PackBits or with Deflate after horizontal differencing. PackBits
+// only finds runs of the same byte, which interleaved RGB of anything but
+// grey never has, so PackBits strips are stored as separate R, G and B planes
+// (each of a strip's three pieces one plane, PackBits row by row).
+class TIFFStripWriter : public StripWriter{
+	void writeEntry(uint16_t tag, uint16_t type, uint32_t count, uint32_t value){
+		write16(tag);
+		write16(type);
+		write32(count);
+		if(type == TIFF_SHORT && count == 1){
+			write16(value);
+			write16(0);
+		}else{
+			write32(value);
+		}
+	}
+
+	void writeHeader(){
+		// Little endian header, directory offset is patched on close
+		fwrite("II", 1, 2, _file);
+		write16(42);
+		write32(0);
+	}
+
+	bool encode(const uint8_t * data, int rows, std::vector<uint8_t>& out, std::vector<uint32_t>& pieces){
+		if(_compression == COMPRESS_PACKBITS){
+			int sampleBytes = _bits/8;
+			std::vector<uint8_t> plane((size_t)_width*sampleBytes);
+			for(int c = 0; c < 3; c++){
+				size_t start = out.size();
+				for(int y = 0; y < rows; y++){
+					const uint8_t * row = data + (size_t)y*getRowBytes();
+					for(int x = 0; x < _width; x++){
+						memcpy(&plane[x*sampleBytes], row + (x*3 + c)*sampleBytes, sampleBytes);
+					}
+					packBits(plane.data(), plane.size(), out);
+				}
+				pieces.push_back(out.size() - start);
+			}
+			return true;
+		}
+		size_t start = out.size();
+		std::vector<uint8_t> differenced(data, data + (size_t)rows*getRowBytes());
+		differenceRows(differenced.data(), _width, rows, _bits);
+		if(!deflateBytes(differenced.data(), differenced.size(), out))
+			return false;
+		pieces.push_back(out.size() - start);
+		return true;
+	}
+
+	void writeTrailer(){
+		// Word align the directory
+		if(ftell(_file) & 1)
+			fputc(0, _file);
+
+		// Planes are listed one after another, each strip by strip
+		int pieces = _stripOffsets.size(), perStrip = getPiecesPerStrip(), strips = pieces/perStrip;
+		std::vector<uint32_t> offsets, counts;
+		for(int p = 0; p < perStrip; p++){
+			for(int s = 0; s < strips; s++){
+				offsets.push_back(_stripOffsets[s*perStrip + p]);
+				counts.push_back(_stripByteCounts[s*perStrip + p]);
+			}
+		}
+
+		bool predictor = (_compression == COMPRESS_DEFLATE);
+		int compression = (_compression == COMPRESS_PACKBITS ? 32773 : _compression == COMPRESS_DEFLATE ? 8 : 1);
+		const int entries = (predictor ? 11 : 10);
+		uint32_t ifdOffset = ftell(_file);
+		uint32_t extraOffset = ifdOffset + 2 + entries*12 + 4;
+		uint32_t bitsOffset = extraOffset;
+		uint32_t offsetsOffset = bitsOffset + 3*2;
+		uint32_t countsOffset = offsetsOffset + pieces*4;
+
+		write16(entries);
+		writeEntry(256, TIFF_LONG, 1, _width);
+		writeEntry(257, TIFF_LONG, 1, _height);
+		writeEntry(258, TIFF_SHORT, 3, bitsOffset);
+		writeEntry(259, TIFF_SHORT, 1, compression);
+		writeEntry(262, TIFF_SHORT, 1, 2); // RGB
+		writeEntry(273, TIFF_LONG, pieces, pieces == 1 ? offsets[0] : offsetsOffset);
+		writeEntry(277, TIFF_SHORT, 1, 3);
+		writeEntry(278, TIFF_LONG, 1, _rowsPerStrip);
+		writeEntry(279, TIFF_LONG, pieces, pieces == 1 ? counts[0] : countsOffset);
+		writeEntry(284, TIFF_SHORT, 1, perStrip == 3 ? 2 : 1); // Planar or chunky
+		if(predictor)
+			writeEntry(317, TIFF_SHORT, 1, 2); // Horizontal differencing
+		write32(0);
+
+		for(int i = 0; i < 3; i++){
+			write16(_bits);
+		}
+		if(pieces > 1){
+			for(int i = 0; i < pieces; i++){
+				write32(offsets[i]);
+			}
+			for(int i = 0; i < pieces; i++){
+				write32(counts[i]);
+			}
+		}
+
+		fseek(_file, 4, SEEK_SET);
+		write32(ifdOffset);
+	}
+
+public:
+	enum{TIFF_SHORT = 3, TIFF_LONG = 4};
+
+	~TIFFStripWriter(){
+		if(_file)
+			close();
+	}
+
+	int getHeaderBytes(){return 8;}
+	int getPiecesPerStrip(){return (_compression == COMPRESS_PACKBITS ? 3 : 1);}
+};
+
+// Raw packed RGB rows in an LZ4 frame, for intermediate caches that are read
+// back by this program or a script rather than an image viewer. The file is
+// a skippable frame holding width, height and bits per sample (3 x uint32),
+// then a standard LZ4 frame with a block (or more, past LZ4_BLOCK_BYTES) per
+// strip, so `lz4 -d` turns it back into the raw rows.
+class LZ4FrameWriter : public StripWriter{
+	void writeHeader(){
+		write32(0x184D2A50); // Skippable frame
+		write32(12);
+		write32(_width);
+		write32(_height);
+		write32(_bits);
+
+		// Independent blocks, no checksums, 4 MB blocks at most
+		uint8_t descriptor[2] = {0x60, 0x70};
+		write32(0x184D2204);
+		fwrite(descriptor, 1, 2, _file);
+		fputc(lz4HeaderChecksum(descriptor, 2), _file);
+	}
+
+	bool encode(const uint8_t * data, int rows, std::vector<uint8_t>& out, std::vector<uint32_t>& pieces){
+		size_t first = out.size(), bytes = (size_t)rows*getRowBytes();
+		for(size_t start = 0; start < bytes; start += LZ4_BLOCK_BYTES){
+			size_t n = std::min((size_t)LZ4_BLOCK_BYTES, bytes - start);
+			size_t header = out.size();
+			out.resize(header + 4);
+			lz4Block(data + start, n, out);
+
+			// High bit of the size marks a block stored as is
+			uint32_t size = out.size() - header - 4;
+			if(size >= n){
+				out.resize(header + 4);
+				out.insert(out.end(), data + start, data + start + n);
+				size = n | 0x80000000u;
+			}
+			memcpy(&out[header], &size, 4);
+		}
+		pieces.push_back(out.size() - first);
+		return true;
+	}
+
+	void writeTrailer(){
+		write32(0); // End mark
+	}
+
+public:
+	~LZ4FrameWriter(){
+		if(_file)
+			close();
+	}
+
+	int getHeaderBytes(){return 8 + 12 + 7;}
+};
+
+// Writer for frames stored with compression
+StripWriter * newStripWriter(Compression compression){
+	if(compression == COMPRESS_LZ4)
+		return new LZ4FrameWriter();
+	return new TIFFStripWriter();
+}
+
+// File extension (without the dot) for frames stored with compression
+const char * frameExtension(Compression compression){
+	return (compression == COMPRESS_LZ4 ? "lz4" : "tif");
+}
+
+// Rows per strip for frames of the given row size, as near STRIP_TARGET_BYTES
+// as possible while dividing band rows exactly (so each band of a banded
+// render is whole strips), or band itself if nothing near enough does
+int stripRows(int rowBytes, int band){
+	int target = std::max(1, STRIP_TARGET_BYTES/rowBytes);
+	if(target >= band)
+		return band;
+	for(int rows = target; 2*rows >= target; rows--){
+		if(band%rows == 0)
+			return rows;
+	}
+	return band;
+}
+
+#endif // TIFF_WRITER_H
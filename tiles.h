@@ -0,0 +1,173 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <EIGEN_SETTINGS.h>
+#include <stdint.h>
+#include <vector>
+
+// Frame space is split into TILE_SIZE square tiles, aligned to the frame
+// origin so that tiles line up between every buffer and band of a frame.
+#define TILE_SIZE 32
+
+// Floor division, so tiles left of or above the origin get negative indices
+inline int tileOf(int p){
+	return (p >= 0 ? p/TILE_SIZE : -((-p + TILE_SIZE - 1)/TILE_SIZE));
+}
+
+// One flag per tile over a rectangle of tiles. Used to say which parts of a
+// region matter (a matte's non-zero tiles, a mask's bounds) so that work on
+// the rest can be skipped. Tiles outside the rectangle read as clear.
+class TileMask{
+	int _tx0, _ty0, _tilesX, _tilesY;
+	std::vector<uint8_t> _tiles;
+
+public:
+	TileMask(): _tx0(0), _ty0(0), _tilesX(0), _tilesY(0){}
+
+	// Tiles touching the frame space rectangle [x0, x1) x [y0, y1)
+	TileMask(int x0, int y0, int x1, int y1, bool value = false){
+		_tx0 = tileOf(x0);
+		_ty0 = tileOf(y0);
+		_tilesX = std::max(0, tileOf(x1 - 1) - _tx0 + 1);
+		_tilesY = std::max(0, tileOf(y1 - 1) - _ty0 + 1);
+		_tiles.assign(_tilesX*_tilesY, value);
+	}
+
+	int getTileX0() const {return _tx0;}
+	int getTileY0() const {return _ty0;}
+	int getTilesX() const {return _tilesX;}
+	int getTilesY() const {return _tilesY;}
+
+	bool test(int tx, int ty) const {
+		tx -= _tx0;
+		ty -= _ty0;
+		if(tx < 0 || ty < 0 || tx >= _tilesX || ty >= _tilesY)
+			return false;
+		return _tiles[ty*_tilesX + tx];
+	}
+
+	void set(int tx, int ty, bool value = true){
+		tx -= _tx0;
+		ty -= _ty0;
+		if(tx < 0 || ty < 0 || tx >= _tilesX || ty >= _tilesY)
+			return;
+		_tiles[ty*_tilesX + tx] = value;
+	}
+
+	// Tile holding pixel (x, y)
+	bool covers(int x, int y) const {return test(tileOf(x), tileOf(y));}
+
+	// Whether any set tile touches the pixel rectangle [x0, x1) x [y0, y1)
+	bool any(int x0, int y0, int x1, int y1) const {
+		if(x1 <= x0 || y1 <= y0)
+			return false;
+		int tx0 = std::max(tileOf(x0), _tx0), tx1 = std::min(tileOf(x1 - 1), _tx0 + _tilesX - 1);
+		int ty0 = std::max(tileOf(y0), _ty0), ty1 = std::min(tileOf(y1 - 1), _ty0 + _tilesY - 1);
+		for(int ty = ty0; ty <= ty1; ty++){
+			for(int tx = tx0; tx <= tx1; tx++){
+				if(_tiles[(ty - _ty0)*_tilesX + (tx - _tx0)])
+					return true;
+			}
+		}
+		return false;
+	}
+
+	// Sets every tile touching the pixel rectangle [x0, x1) x [y0, y1)
+	void setRect(int x0, int y0, int x1, int y1){
+		if(x1 <= x0 || y1 <= y0)
+			return;
+		for(int ty = tileOf(y0); ty <= tileOf(y1 - 1); ty++){
+			for(int tx = tileOf(x0); tx <= tileOf(x1 - 1); tx++){
+				set(tx, ty);
+			}
+		}
+	}
+
+	bool isEmpty() const {
+		for(int i = 0; i < _tiles.size(); i++){
+			if(_tiles[i])
+				return false;
+		}
+		return true;
+	}
+
+	int count() const {
+		int n = 0;
+		for(int i = 0; i < _tiles.size(); i++){
+			n += _tiles[i];
+		}
+		return n;
+	}
+
+	// Also sets the tiles set in other, within this grid
+	void merge(const TileMask& other){
+		for(int ty = 0; ty < _tilesY; ty++){
+			for(int tx = 0; tx < _tilesX; tx++){
+				uint8_t& tile = _tiles[ty*_tilesX + tx];
+				tile = tile || other.test(_tx0 + tx, _ty0 + ty);
+			}
+		}
+	}
+
+	// Calls fn(run_x0, run_x1) for each run of set tiles along pixel row y,
+	// clipped to [x0, x1)
+	template<typename Fn>
+	void forEachRun(int y, int x0, int x1, Fn fn) const {
+		int ty = tileOf(y) - _ty0;
+		if(ty < 0 || ty >= _tilesY || x1 <= x0)
+			return;
+
+		const uint8_t * row = &_tiles[ty*_tilesX];
+		int tx = std::max(tileOf(x0) - _tx0, 0), tx1 = std::min(tileOf(x1 - 1) - _tx0, _tilesX - 1);
+		while(tx <= tx1){
+			if(!row[tx]){
+				tx++;
+				continue;
+			}
+			int start = tx;
+			while(tx <= tx1 && row[tx]){
+				tx++;
+			}
+			fn(std::max(x0, (start + _tx0)*TILE_SIZE), std::min(x1, (tx + _tx0)*TILE_SIZE));
+		}
+	}
+
+	// Keeps only the tiles also set in other
+	void intersect(const TileMask& other){
+		for(int ty = 0; ty < _tilesY; ty++){
+			for(int tx = 0; tx < _tilesX; tx++){
+				uint8_t& tile = _tiles[ty*_tilesX + tx];
+				tile = tile && other.test(_tx0 + tx, _ty0 + ty);
+			}
+		}
+	}
+
+	// Every tile within pixels of a set tile, on a grid grown to hold them
+	TileMask dilated(int pixels) const {
+		int reach = (pixels + TILE_SIZE - 1)/TILE_SIZE;
+		if(reach <= 0)
+			return *this;
+
+		TileMask out;
+		out._tx0 = _tx0 - reach;
+		out._ty0 = _ty0 - reach;
+		out._tilesX = _tilesX + 2*reach;
+		out._tilesY = _tilesY + 2*reach;
+		out._tiles.assign(out._tilesX*out._tilesY, 0);
+		for(int ty = 0; ty < _tilesY; ty++){
+			for(int tx = 0; tx < _tilesX; tx++){
+				if(!_tiles[ty*_tilesX + tx])
+					continue;
+				// Grown grid coordinates of this tile are (tx + reach, ty + reach)
+				for(int y = ty; y <= ty + 2*reach; y++){
+					for(int x = tx; x <= tx + 2*reach; x++){
+						out._tiles[y*out._tilesX + x] = 1;
+					}
+				}
+			}
+		}
+		return out;
+	}
+};
+
+#endif // TILES_H
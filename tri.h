@@ -6,17 +6,8 @@
 #include "pixel.h"
 #include "funmath.h"
 #include "keyframe.h"
-
-
-class Geometry{
-	
-public:
-	Geometry(){
-
-	}
-	virtual ~Geometry(){}
-	virtual bool getColor(const VEC2& pos, VEC3 * col_out) = 0;
-};
+#include "simd.h"
+#include "geometry.h"
 
 
 class Tri : public Geometry{
@@ -68,6 +59,12 @@ public:
 		return ((*coords)[0] >= 0 && (*coords)[1] >= 0 && (*coords)[2] >= 0);
 	}
 
+	bool getBounds(VEC2& min_out, VEC2& max_out){
+		min_out = P0.cwiseMin(P1).cwiseMin(P2);
+		max_out = P0.cwiseMax(P1).cwiseMax(P2);
+		return true;
+	}
+
 	bool getColor(const VEC2& pos, VEC3 * col_out){
 		VEC3 coords;
 		getBarryCoords(pos, &coords);
@@ -95,6 +92,15 @@ public:
 		t2.setTexCoords(VEC2(1, 0), VEC2(1, 1), VEC2(0, 1));
 	}
 
+	bool getBounds(VEC2& min_out, VEC2& max_out){
+		VEC2 min2, max2;
+		if(!t1.getBounds(min_out, max_out) || !t2.getBounds(min2, max2))
+			return false;
+		min_out = min_out.cwiseMin(min2);
+		max_out = max_out.cwiseMax(max2);
+		return true;
+	}
+
 	bool getColor(const VEC2& pos, VEC3 * col_out){
 		if(t1.getColor(pos, col_out)){
 			return true;
@@ -128,6 +134,15 @@ public:
 		delete sourceTexture;
 	}
 
+	bool getBounds(VEC2& min_out, VEC2& max_out){
+		VEC2 min2, max2;
+		if(!t1.getBounds(min_out, max_out) || !t2.getBounds(min2, max2))
+			return false;
+		min_out = min_out.cwiseMin(min2);
+		max_out = max_out.cwiseMax(max2);
+		return true;
+	}
+
 	bool getColor(const VEC2& pos, VEC3 * col_out){
 		VEC3 barryCoords;
 		Tri * hit;
@@ -156,53 +171,285 @@ public:
 	}
 };
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////TRIANGLE STORE/////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+enum PrimitiveKind{
+	PRIM_FLAT,
+	PRIM_TEXTURED
+};
+
+// Triangles of a single primitive kind, stored as structure-of-arrays.
+// setup() derives everything that is constant over a triangle (orientation,
+// edge equations, screen bounds, UV planes) once per frame, so the rasterizer
+// only has to evaluate linear functions per pixel.
+struct TriStore{
+	// Vertices
+	std::vector<float> x0, y0, x1, y1, x2, y2;
+
+	// PRIM_FLAT attributes
+	std::vector<float> r, g, b;
+
+	// PRIM_TEXTURED attributes
+	std::vector<float> u0, v0, u1, v1, u2, v2;
+	std::vector<int> texture;
+
+	// Per-frame setup. Edge e is E(Q) = edgeA*(Q.y - edgeY) - edgeB*(Q.x - edgeX),
+	// oriented so that the inside of the triangle is E >= 0.
+	std::vector<float> edgeA[3], edgeB[3], edgeX[3], edgeY[3];
+	std::vector<int> minX, minY, maxX, maxY;
+	std::vector<double> dudx, dudy, dvdx, dvdy;
+
+	int size(){return x0.size();}
+
+	void addVertices(const VEC2& P0, const VEC2& P1, const VEC2& P2){
+		x0.push_back(P0[0]); y0.push_back(P0[1]);
+		x1.push_back(P1[0]); y1.push_back(P1[1]);
+		x2.push_back(P2[0]); y2.push_back(P2[1]);
+	}
+
+	void addColor(const VEC3& col){
+		r.push_back(col[0]);
+		g.push_back(col[1]);
+		b.push_back(col[2]);
+	}
+
+	void addTexCoords(const VEC2& TEX0, const VEC2& TEX1, const VEC2& TEX2, int tex){
+		u0.push_back(TEX0[0]); v0.push_back(TEX0[1]);
+		u1.push_back(TEX1[0]); v1.push_back(TEX1[1]);
+		u2.push_back(TEX2[0]); v2.push_back(TEX2[1]);
+		texture.push_back(tex);
+	}
+
+	// Bounds are clipped to the frame space rectangle [clipX0, clipX1) x [clipY0, clipY1)
+	void setup(int clipX0, int clipY0, int clipX1, int clipY1){
+		int n = size();
+		for(int e = 0; e < 3; e++){
+			edgeA[e].resize(n); edgeB[e].resize(n);
+			edgeX[e].resize(n); edgeY[e].resize(n);
+		}
+		minX.resize(n); minY.resize(n); maxX.resize(n); maxY.resize(n);
+		bool textured = (texture.size() > 0);
+		if(textured){
+			dudx.resize(n); dudy.resize(n); dvdx.resize(n); dvdy.resize(n);
+		}
+
+		for(int i = 0; i < n; i++){
+			// Twice the signed area, same sign convention as Tri::getBarryCoords
+			double area2 = (double)(x1[i]-x0[i])*(y2[i]-y0[i]) - (double)(y1[i]-y0[i])*(x2[i]-x0[i]);
+			if(area2 == 0){
+				// Degenerate, covers nothing
+				minX[i] = 0; maxX[i] = -1;
+				minY[i] = 0; maxY[i] = -1;
+				continue;
+			}
+			float orient = (area2 < 0 ? -1.0f : 1.0f);
+
+			edgeA[0][i] = orient*(x2[i]-x1[i]);  edgeB[0][i] = orient*(y2[i]-y1[i]);
+			edgeX[0][i] = x1[i];                 edgeY[0][i] = y1[i];
+			edgeA[1][i] = -orient*(x2[i]-x0[i]); edgeB[1][i] = -orient*(y2[i]-y0[i]);
+			edgeX[1][i] = x0[i];                 edgeY[1][i] = y0[i];
+			edgeA[2][i] = orient*(x1[i]-x0[i]);  edgeB[2][i] = orient*(y1[i]-y0[i]);
+			edgeX[2][i] = x0[i];                 edgeY[2][i] = y0[i];
+
+			// Pixels are sampled at integer coordinates
+			minX[i] = std::max(clipX0, (int)std::ceil(std::min(x0[i], std::min(x1[i], x2[i]))));
+			minY[i] = std::max(clipY0, (int)std::ceil(std::min(y0[i], std::min(y1[i], y2[i]))));
+			maxX[i] = std::min(clipX1-1, (int)std::floor(std::max(x0[i], std::max(x1[i], x2[i]))));
+			maxY[i] = std::min(clipY1-1, (int)std::floor(std::max(y0[i], std::max(y1[i], y2[i]))));
+
+			if(textured){
+				// Barycentric weights are linear in Q, so UVs are planes anchored at P0
+				double inv = 1.0/area2;
+				double a0 = -(y2[i]-y1[i]), b0 = (x2[i]-x1[i]);
+				double a1 = (y2[i]-y0[i]),  b1 = -(x2[i]-x0[i]);
+				double a2 = -(y1[i]-y0[i]), b2 = (x1[i]-x0[i]);
+				dudx[i] = (u0[i]*a0 + u1[i]*a1 + u2[i]*a2)*inv;
+				dudy[i] = (u0[i]*b0 + u1[i]*b1 + u2[i]*b2)*inv;
+				dvdx[i] = (v0[i]*a0 + v1[i]*a1 + v2[i]*a2)*inv;
+				dvdy[i] = (v0[i]*b0 + v1[i]*b1 + v2[i]*b2)*inv;
+			}
+		}
+	}
+
+	// Coverage of pixels (xs, y) ... (xs+7, y) as a lane bitmask
+	int coverage8(int i, int xs, int y){
+		float8 qx = float8((float)xs) + float8::ramp();
+		float fy = (float)y;
+		float8 inside = (qx <= float8((float)maxX[i]));
+		for(int e = 0; e < 3; e++){
+			float8 E = float8(edgeA[e][i]*(fy - edgeY[e][i])) - float8(edgeB[e][i])*(qx - float8(edgeX[e][i]));
+			inside = inside & (E >= float8(0.0f));
+		}
+		return movemask(inside);
+	}
+};
+
 class Shapes : public Layer{
-	std::vector<Geometry *> geo;
-public:
-	// Each object should manage its own memory... think about that...
-	// Maybe addTri should allocate its own memory for a tri object
-	Shapes(){}
-	~Shapes(){
-		for(int i = 0; i < geo.size(); i++){
-			delete geo[i];
+	struct DrawRun{
+		PrimitiveKind kind;
+		int begin, end;
+	};
+
+	TriStore _flat;
+	TriStore _textured;
+	std::vector<ImageBuffer *> _textures;
+	std::vector<DrawRun> _runs; // Keeps primitives in the order they were added
+
+	void pushRun(PrimitiveKind kind, int index){
+		if(_runs.size() > 0 && _runs.back().kind == kind && _runs.back().end == index){
+			_runs.back().end++;
+		}else{
+			DrawRun run;
+			run.kind = kind;
+			run.begin = index;
+			run.end = index + 1;
+			_runs.push_back(run);
 		}
 	}
 
+	void addFlatTri(const VEC2& P0, const VEC2& P1, const VEC2& P2, const VEC3& col){
+		pushRun(PRIM_FLAT, _flat.size());
+		_flat.addVertices(P0, P1, P2);
+		_flat.addColor(col);
+	}
 
-	void render(ImageBuffer * target, float frame_num){
-		int xRes, yRes;
-		target->getDimensions(xRes, yRes);
-		for(int y = 0; y < yRes; y++){
-			for(int x = 0; x < xRes; x++){
-				for(int i = 0; i < geo.size(); i++){
+	void addTexturedTri(const VEC2& P0, const VEC2& P1, const VEC2& P2,
+		const VEC2& TEX0, const VEC2& TEX1, const VEC2& TEX2, int tex){
+		pushRun(PRIM_TEXTURED, _textured.size());
+		_textured.addVertices(P0, P1, P2);
+		_textured.addTexCoords(TEX0, TEX1, TEX2, tex);
+	}
+
+	// Whether a coverage mask leaves out all of the pixel rectangle [x0, x1) x [y0, y1)
+	static bool hidden(const TileMask * coverage, int x0, int y0, int x1, int y1){
+		return coverage && !coverage->any(x0, y0, x1, y1);
+	}
 
-					VEC3 col;
-					Geometry * geometry = geo[i];
-					if(geometry->getColor(VEC2(x, y), &col)){
-						target->getPixel(x, y)->set(col);
+	void rasterizeFlat(const ImageView& target, int begin, int end, const TileMask * coverage){
+		for(int i = begin; i < end; i++){
+			if(hidden(coverage, _flat.minX[i], _flat.minY[i], _flat.maxX[i] + 1, _flat.maxY[i] + 1))
+				continue;
+			target.markWritten(_flat.minX[i], _flat.minY[i], _flat.maxX[i] + 1, _flat.maxY[i] + 1);
+
+			float r = _flat.r[i], g = _flat.g[i], b = _flat.b[i];
+			for(int y = _flat.minY[i]; y <= _flat.maxY[i]; y++){
+				Pixel * row = target.row(y) - target.getX0();
+				for(int xs = _flat.minX[i]; xs <= _flat.maxX[i]; xs += 8){
+					if(hidden(coverage, xs, y, xs + 8, y + 1))
+						continue;
+
+					int bits = _flat.coverage8(i, xs, y);
+					while(bits){
+						int lane = __builtin_ctz(bits);
+						bits &= bits - 1;
+						row[xs + lane].set(r, g, b, 1);
 					}
+				}
+			}
+		}
+	}
 
+	void rasterizeTextured(const ImageView& target, int begin, int end, const TileMask * coverage){
+		int sample_x[8], sample_y[8];
+		for(int i = begin; i < end; i++){
+			if(hidden(coverage, _textured.minX[i], _textured.minY[i], _textured.maxX[i] + 1, _textured.maxY[i] + 1))
+				continue;
+			target.markWritten(_textured.minX[i], _textured.minY[i], _textured.maxX[i] + 1, _textured.maxY[i] + 1);
+
+			ImageBuffer * tex = _textures[_textured.texture[i]];
+			int texX, texY;
+			tex->getDimensions(texX, texY);
+			ImageView texels = tex->view();
+
+			// Texel space planes. Block origins are evaluated in double so texel
+			// boundaries that fall exactly on a pixel round the same way as Texture.
+			double dudx = _textured.dudx[i]*(texX-1), dudy = _textured.dudy[i]*(texX-1);
+			double dvdx = _textured.dvdx[i]*(texY-1), dvdy = _textured.dvdy[i]*(texY-1);
+			float8 uStep = float8((float)dudx)*float8::ramp();
+			float8 vStep = float8((float)dvdx)*float8::ramp();
+			for(int y = _textured.minY[i]; y <= _textured.maxY[i]; y++){
+				Pixel * row = target.row(y) - target.getX0();
+				double dy = y - _textured.y0[i];
+				double uRow = _textured.u0[i]*(texX-1) + dudy*dy;
+				double vRow = _textured.v0[i]*(texY-1) + dvdy*dy;
+				for(int xs = _textured.minX[i]; xs <= _textured.maxX[i]; xs += 8){
+					if(hidden(coverage, xs, y, xs + 8, y + 1))
+						continue;
+
+					int bits = _textured.coverage8(i, xs, y);
+					if(!bits)
+						continue;
+
+					double dx = xs - _textured.x0[i];
+					(float8((float)(uRow + dudx*dx)) + uStep).storeTruncated(sample_x);
+					(float8((float)(vRow + dvdx*dx)) + vStep).storeTruncated(sample_y);
+					while(bits){
+						int lane = __builtin_ctz(bits);
+						bits &= bits - 1;
+						int sx = std::min(std::max(sample_x[lane], 0), texX-1);
+						int sy = std::min(std::max(sample_y[lane], 0), texY-1);
+						Pixel& texel = texels.row(texY-sy-1)[texX-sx-1];
+						row[xs + lane].set(texel.getR(), texel.getG(), texel.getB(), 1);
+					}
 				}
 			}
 		}
 	}
 
+public:
+	Shapes(){}
+	~Shapes(){
+		for(int i = 0; i < _textures.size(); i++){
+			delete _textures[i];
+		}
+	}
+
+
+	bool tracksWrites(){return true;}
+
+	void render(const ImageView& target, float frame_num, const TileMask * coverage = nullptr){
+		_flat.setup(target.getX0(), target.getY0(), target.getX1(), target.getY1());
+		_textured.setup(target.getX0(), target.getY0(), target.getX1(), target.getY1());
+
+		for(int i = 0; i < _runs.size(); i++){
+			if(_runs[i].kind == PRIM_FLAT)
+				rasterizeFlat(target, _runs[i].begin, _runs[i].end, coverage);
+			else
+				rasterizeTextured(target, _runs[i].begin, _runs[i].end, coverage);
+		}
+	}
+
 	void addTri(VEC2 P0, VEC2 P1, VEC2 P2, VEC3 col){
-		Tri * tri = new Tri(P0, P1, P2);
-		tri->setColor(col);
-		geo.push_back(tri);
+		addFlatTri(P0, P1, P2, col);
 	}
 
 	void addQuad(VEC2 P0, VEC2 P1){
-		Quad * quad = new Quad(P0, P1);
-		geo.push_back(quad);
+		if(P1[0] <= P0[0] || P1[1] <= P0[1]){
+			ERROR("ERROR - QUAD - P1 must be greater than P0");
+			return;
+		}
+
+		// Same split and colour as Quad
+		VEC3 col(255, 0, 0);
+		addFlatTri(P1, P0, VEC2(P0[0], P1[1]), col);
+		addFlatTri(P1, VEC2(P1[0], P0[1]), P0, col);
 	}
 
 	void addTexture(VEC2 P0, VEC2 P1, char * source){
-		Texture * tex = new Texture(P0, P1, source);
-		geo.push_back(tex);
+		if(P1[0] <= P0[0] || P1[1] <= P0[1]){
+			ERROR("ERROR - TEXTURE - P1 must be greater than P0");
+			return;
+		}
+
+		// Same split and texture coordinates as Texture
+		int tex = _textures.size();
+		_textures.push_back(new ImageBuffer(source));
+		addTexturedTri(P1, P0, VEC2(P0[0], P1[1]), VEC2(1, 0), VEC2(0, 1), VEC2(0, 0), tex);
+		addTexturedTri(P1, VEC2(P1[0], P0[1]), P0, VEC2(1, 0), VEC2(1, 1), VEC2(0, 1), tex);
 	}
 
 };
 
-#endif // TRI_H
\ No newline at end of file
+#endif // TRI_H